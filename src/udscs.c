@@ -28,7 +28,9 @@
 #include <stdlib.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "udscs.h"
@@ -37,6 +39,7 @@ struct udscs_buf {
     uint8_t *buf;
     size_t pos;
     size_t size;
+    int fd; /* fd to pass along with the first byte of buf, or -1 */
 
     struct udscs_buf *next;
 };
@@ -55,6 +58,7 @@ struct udscs_connection {
     int header_read;
     struct udscs_message_header header;
     struct udscs_buf data;
+    int data_fd; /* fd received along with the current message, or -1 */
 
     /* Writes are stored in a linked list of buffers, with both the header
        + data for a single message in 1 buffer. */
@@ -84,6 +88,7 @@ struct udscs_connection *udscs_connect(const char *socketname,
     conn->type_to_string = type_to_string;
     conn->no_types = no_types;
     conn->debug = debug;
+    conn->data_fd = -1;
 
     conn->fd = socket(PF_UNIX, SOCK_STREAM, 0);
     if (conn->fd == -1) {
@@ -126,6 +131,8 @@ void udscs_destroy_connection(struct udscs_connection **connp)
     wbuf = conn->write_buf;
     while (wbuf) {
         next_wbuf = wbuf->next;
+        if (wbuf->fd != -1)
+            close(wbuf->fd);
         free(wbuf->buf);
         free(wbuf);
         wbuf = next_wbuf;
@@ -133,6 +140,8 @@ void udscs_destroy_connection(struct udscs_connection **connp)
 
     free(conn->data.buf);
     conn->data.buf = NULL;
+    if (conn->data_fd != -1)
+        close(conn->data_fd);
 
     if (conn->next)
         conn->next->prev = conn->prev;
@@ -161,8 +170,22 @@ void *udscs_get_user_data(struct udscs_connection *conn)
     return conn->user_data;
 }
 
+int udscs_steal_message_fd(struct udscs_connection *conn)
+{
+    int fd = conn->data_fd;
+
+    conn->data_fd = -1;
+    return fd;
+}
+
 int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
     uint32_t arg2, const uint8_t *data, uint32_t size)
+{
+    return udscs_write_fd(conn, type, arg1, arg2, data, size, -1);
+}
+
+int udscs_write_fd(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, const uint8_t *data, uint32_t size, int fd)
 {
     struct udscs_buf *wbuf, *new_wbuf;
     struct udscs_message_header header;
@@ -174,12 +197,23 @@ int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
     new_wbuf->pos = 0;
     new_wbuf->size = sizeof(header) + size;
     new_wbuf->next = NULL;
+    new_wbuf->fd = -1;
     new_wbuf->buf = malloc(new_wbuf->size);
     if (!new_wbuf->buf) {
         free(new_wbuf);
         return -1;
     }
 
+    if (fd != -1) {
+        new_wbuf->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (new_wbuf->fd == -1) {
+            syslog(LOG_ERR, "%p dup fd for sending: %m", conn);
+            free(new_wbuf->buf);
+            free(new_wbuf);
+            return -1;
+        }
+    }
+
     header.type = type;
     header.arg1 = arg1;
     header.arg2 = arg2;
@@ -240,6 +274,51 @@ static void udscs_read_complete(struct udscs_connection **connp)
     free(conn->data.buf);
     memset(&conn->data, 0, sizeof(conn->data)); /* data.buf = NULL */
     conn->header_read = 0;
+
+    /* Close any passed fd the read callback did not claim */
+    if (conn->data_fd != -1) {
+        close(conn->data_fd);
+        conn->data_fd = -1;
+    }
+}
+
+/* A helper for udscs_do_read(), reads like read() but also picks up
+   any fd passed through SCM_RIGHTS along with the data */
+static ssize_t udscs_recv(struct udscs_connection *conn, uint8_t *dest,
+    size_t to_read)
+{
+    ssize_t n;
+    struct iovec iov = { .iov_base = dest, .iov_len = to_read };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+
+    n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return n;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+                cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+            continue;
+        if (conn->data_fd != -1) {
+            syslog(LOG_ERR, "%p received more than 1 fd for a message", conn);
+            close(conn->data_fd);
+        }
+        memcpy(&conn->data_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (msg.msg_flags & MSG_CTRUNC)
+        syslog(LOG_ERR, "%p passed fd(s) got truncated", conn);
+
+    return n;
 }
 
 /* A helper for udscs_client_handle_fds() */
@@ -258,7 +337,7 @@ static void udscs_do_read(struct udscs_connection **connp)
         dest = conn->data.buf + conn->data.pos;
     }
 
-    n = read(conn->fd, dest, to_read);
+    n = udscs_recv(conn, dest, to_read);
     if (n < 0) {
         if (errno == EINTR)
             return;
@@ -309,7 +388,36 @@ static void udscs_do_write(struct udscs_connection **connp)
     }
 
     to_write = wbuf->size - wbuf->pos;
-    n = write(conn->fd, wbuf->buf + wbuf->pos, to_write);
+    if (wbuf->fd != -1) {
+        /* The fd travels with the first byte we manage to send */
+        struct iovec iov = { .iov_base = wbuf->buf + wbuf->pos,
+                             .iov_len = to_write };
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+        memset(&control, 0, sizeof(control));
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &wbuf->fd, sizeof(int));
+
+        n = sendmsg(conn->fd, &msg, 0);
+        if (n > 0) {
+            close(wbuf->fd);
+            wbuf->fd = -1;
+        }
+    } else {
+        n = write(conn->fd, wbuf->buf + wbuf->pos, to_write);
+    }
     if (n < 0) {
         if (errno == EINTR)
             return;
@@ -461,6 +569,7 @@ static void udscs_server_accept(struct udscs_server *server) {
     }
 
     new_conn->fd = fd;
+    new_conn->data_fd = -1;
     new_conn->type_to_string = server->type_to_string;
     new_conn->no_types = server->no_types;
     new_conn->debug = server->debug;
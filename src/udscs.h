@@ -100,6 +100,13 @@ void udscs_client_handle_fds(struct udscs_connection **connp, fd_set *readfds,
 int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
         uint32_t arg2, const uint8_t *data, uint32_t size);
 
+/* Like udscs_write, but also pass the file descriptor fd to the other end
+ * using SCM_RIGHTS. fd gets dup-ed, the caller keeps ownership of it.
+ * Return value: 0 on success -1 on error.
+ */
+int udscs_write_fd(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, const uint8_t *data, uint32_t size, int fd);
+
 /* Associates the specified user data with the connection. */
 void udscs_set_user_data(struct udscs_connection *conn, void *data);
 
@@ -108,6 +115,13 @@ void udscs_set_user_data(struct udscs_connection *conn, void *data);
  */
 void *udscs_get_user_data(struct udscs_connection *conn);
 
+/* To be called from a read callback, takes ownership of the file descriptor
+ * which was passed along with the message being handled, if any.
+ * If the read callback does not take it, the fd gets closed when it returns.
+ * Return value: the fd, or -1 if no fd was passed with the message.
+ */
+int udscs_steal_message_fd(struct udscs_connection *conn);
+
 
 #ifndef UDSCS_NO_SERVER
 
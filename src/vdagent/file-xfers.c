@@ -35,26 +35,51 @@
 #include <sys/types.h>
 #include <spice/vd_agent.h>
 #include <glib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "vdagentd-proto.h"
 #include "file-xfers.h"
 
+/* Max number of paths we remember the next free " (%i)" suffix for */
+#define NAME_SUFFIX_CACHE_SIZE 1024
+
 struct vdagent_file_xfers {
     GHashTable *xfers;
+    /* Next " (%i)" suffix to try per file path, so that dropping many files
+       with the same name does not probe all the existing copies every time */
+    GHashTable *name_suffixes;
     struct udscs_connection *vdagentd;
     char *save_dir;
     int open_save_dir;
+    int sync;
     int debug;
 };
 
 typedef struct AgentFileXferTask {
     uint32_t                       id;
     int                            file_fd;
+    int                            dir_fd;
+    /* Name of the hidden file the data goes to if O_TMPFILE is not
+       supported, relative to dir_fd */
+    char                           *temp_name;
     uint64_t                       read_bytes;
+    uint32_t                       unacked_bytes;
     char                           *file_name;
     uint64_t                       file_size;
     int                            file_xfer_nr;
     int                            file_xfer_total;
+    /* Read end of the pipe vdagentd writes the data to, if any */
+    int                            pipe_fd;
+#ifdef HAVE_ZSTD
+    /* For xfers with compression=zstd, read_bytes then counts the
+       decompressed bytes */
+    ZSTD_DStream                   *zstd;
+    uint8_t                        *zstd_buf;
+    size_t                         zstd_buf_size;
+    size_t                         zstd_hint; /* 0 once a frame is complete */
+#endif
     int                            debug;
 } AgentFileXferTask;
 
@@ -64,31 +89,47 @@ static void vdagent_file_xfer_task_free(gpointer data)
 
     g_return_if_fail(task != NULL);
 
+    /* Until it is complete the file is either anonymous (O_TMPFILE), or
+       has a temporary name, so there is nothing visible to remove */
     if (task->file_fd > 0) {
         syslog(LOG_ERR, "file-xfer: Removing task %u and file %s due to error",
                task->id, task->file_name);
         close(task->file_fd);
-        unlink(task->file_name);
+        if (task->temp_name)
+            unlinkat(task->dir_fd, task->temp_name, 0);
     } else if (task->debug)
         syslog(LOG_DEBUG, "file-xfer: Removing task %u %s",
                task->id, task->file_name);
 
+    if (task->dir_fd > 0)
+        close(task->dir_fd);
+    if (task->pipe_fd > 0)
+        close(task->pipe_fd);
+#ifdef HAVE_ZSTD
+    if (task->zstd)
+        ZSTD_freeDStream(task->zstd);
+    g_free(task->zstd_buf);
+#endif
+    g_free(task->temp_name);
     g_free(task->file_name);
     g_free(task);
 }
 
 struct vdagent_file_xfers *vdagent_file_xfers_create(
     struct udscs_connection *vdagentd, const char *save_dir,
-    int open_save_dir, int debug)
+    int open_save_dir, int sync, int debug)
 {
     struct vdagent_file_xfers *xfers;
 
     xfers = g_malloc(sizeof(*xfers));
     xfers->xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
                                          NULL, vdagent_file_xfer_task_free);
+    xfers->name_suffixes = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, NULL);
     xfers->vdagentd = vdagentd;
     xfers->save_dir = g_strdup(save_dir);
     xfers->open_save_dir = open_save_dir;
+    xfers->sync = sync;
     xfers->debug = debug;
 
     return xfers;
@@ -99,10 +140,20 @@ void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfers)
     g_return_if_fail(xfers != NULL);
 
     g_hash_table_destroy(xfers->xfers);
+    g_hash_table_destroy(xfers->name_suffixes);
     g_free(xfers->save_dir);
     g_free(xfers);
 }
 
+static int vdagent_file_xfer_task_is_compressed(AgentFileXferTask *task)
+{
+#ifdef HAVE_ZSTD
+    if (task->zstd)
+        return 1;
+#endif
+    return 0;
+}
+
 static AgentFileXferTask *vdagent_file_xfers_get_task(
     struct vdagent_file_xfers *xfers, uint32_t id)
 {
@@ -124,6 +175,7 @@ static AgentFileXferTask *vdagent_parse_start_msg(
     GKeyFile *keyfile = NULL;
     AgentFileXferTask *task = NULL;
     GError *error = NULL;
+    char *compression = NULL;
 
     keyfile = g_key_file_new();
     if (g_key_file_load_from_data(keyfile,
@@ -155,12 +207,39 @@ static AgentFileXferTask *vdagent_parse_start_msg(
         keyfile, "vdagent-file-xfer", "file-xfer-nr", NULL);
     task->file_xfer_total = g_key_file_get_integer(
         keyfile, "vdagent-file-xfer", "file-xfer-total", NULL);
+    /* Optional, the data is sent compressed, size is the uncompressed size.
+       There is no capability for this, clients find out from the error
+       status we reply with when the method is not supported, and can then
+       resend the file uncompressed. */
+    compression = g_key_file_get_string(
+        keyfile, "vdagent-file-xfer", "compression", NULL);
+    if (compression && strcmp(compression, "none") != 0) {
+#ifdef HAVE_ZSTD
+        if (strcmp(compression, "zstd") == 0) {
+            task->zstd = ZSTD_createDStream();
+            if (!task->zstd || ZSTD_isError(ZSTD_initDStream(task->zstd))) {
+                syslog(LOG_ERR, "file-xfer: failed to init zstd decompression");
+                goto error;
+            }
+            task->zstd_buf_size = ZSTD_DStreamOutSize();
+            task->zstd_buf = g_malloc(task->zstd_buf_size);
+            task->zstd_hint = 1;
+        } else
+#endif
+        {
+            syslog(LOG_ERR, "file-xfer: unsupported compression: %s",
+                   compression);
+            goto error;
+        }
+    }
 
+    g_free(compression);
     g_key_file_free(keyfile);
     return task;
 
 error:
     g_clear_error(&error);
+    g_free(compression);
     if (task)
         vdagent_file_xfer_task_free(task);
     if (keyfile)
@@ -168,13 +247,164 @@ error:
     return NULL;
 }
 
+/* Create the file the data gets written to, this is an anonymous file
+   in dir if the filesystem supports O_TMPFILE, and a hidden file otherwise,
+   so that the file only shows up under its name once it is complete.
+   Return value: 0 on success, -1 on error */
+static int vdagent_file_xfer_task_create_file(AgentFileXferTask *task,
+    const char *dir)
+{
+    int i;
+
+    task->dir_fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (task->dir_fd == -1) {
+        syslog(LOG_ERR, "file-xfer: failed to open dir %s: %s", dir,
+               strerror(errno));
+        return -1;
+    }
+
+#ifdef O_TMPFILE
+    task->file_fd = openat(task->dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC,
+                           0644);
+    if (task->file_fd != -1)
+        return 0;
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+        syslog(LOG_ERR, "file-xfer: failed to create file in %s: %s",
+               dir, strerror(errno));
+        return -1;
+    }
+#endif
+
+    for (i = 0; i < 64; i++) {
+        g_free(task->temp_name);
+        task->temp_name = g_strdup_printf(".spice-file-xfer-%u-%08x",
+                                          task->id, g_random_int());
+        task->file_fd = openat(task->dir_fd, task->temp_name,
+                               O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+        if (task->file_fd != -1 || errno != EEXIST)
+            break;
+    }
+    if (task->file_fd == -1) {
+        syslog(LOG_ERR, "file-xfer: failed to create file %s in %s: %s",
+               task->temp_name, dir, strerror(errno));
+        g_free(task->temp_name);
+        task->temp_name = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Like renameat() but fails with EEXIST rather than replacing an
+   existing file */
+static int rename_noreplace(int dir_fd, const char *from, const char *to)
+{
+    struct stat st;
+
+    if (linkat(dir_fd, from, dir_fd, to, 0) == 0) {
+        unlinkat(dir_fd, from, 0);
+        return 0;
+    }
+    if (errno != EPERM && errno != EOPNOTSUPP)
+        return -1;
+
+    /* No hard link support (vfat), this is not race free but it is the
+       best we can do there */
+    if (fstatat(dir_fd, to, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
+        errno = EEXIST;
+        return -1;
+    }
+    return renameat(dir_fd, from, dir_fd, to);
+}
+
+/* Give the completed file its final name, adding a " (%i)" suffix if a file
+   with the requested name already exists. Since the file gets linked in place
+   atomically, no existing file ever gets overwritten.
+   Return value: 0 on success, -1 on error */
+static int vdagent_file_xfer_task_link(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task)
+{
+    char *name = NULL, *base, *dir, *extension, proc_path[64];
+    int basename_len, i, n, r = -1, start;
+
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", task->file_fd);
+    base = g_path_get_basename(task->file_name);
+    dir = g_path_get_dirname(task->file_name);
+    extension = strrchr(base, '.');
+    basename_len = extension != NULL ? extension - base : strlen(base);
+    start = GPOINTER_TO_INT(g_hash_table_lookup(xfers->name_suffixes,
+                                                task->file_name));
+    for (n = 0; n < 64; n++) {
+        i = (start + n) % 64;
+        g_free(name);
+        if (i == 0)
+            name = g_strdup(base);
+        else
+            name = g_strdup_printf("%.*s (%i)%s", basename_len, base, i,
+                                   extension ? extension : "");
+        if (task->temp_name)
+            r = rename_noreplace(task->dir_fd, task->temp_name, name);
+        else
+            r = linkat(AT_FDCWD, proc_path, task->dir_fd, name,
+                       AT_SYMLINK_FOLLOW);
+        if (r == 0 || errno != EEXIST)
+            break;
+    }
+
+    if (r == 0) {
+        if (g_hash_table_size(xfers->name_suffixes) >= NAME_SUFFIX_CACHE_SIZE)
+            g_hash_table_remove_all(xfers->name_suffixes);
+        g_hash_table_insert(xfers->name_suffixes, g_strdup(task->file_name),
+                            GINT_TO_POINTER((i + 1) % 64));
+        g_free(task->temp_name);
+        task->temp_name = NULL;
+        g_free(task->file_name);
+        task->file_name = g_build_filename(dir, name, NULL);
+    } else if (n == 64) {
+        syslog(LOG_ERR, "file-xfer: more than 63 copies of %s exist?",
+               task->file_name);
+    } else {
+        syslog(LOG_ERR, "file-xfer: failed to create file %s/%s: %s",
+               dir, name, strerror(errno));
+    }
+
+    g_free(name);
+    g_free(dir);
+    g_free(base);
+    return r;
+}
+
+/* Have vdagentd write the data to a pipe rather than sending us every
+   chunk, we then splice it from the pipe to the file. If vdagentd does not
+   take the pipe it simply closes it and sends the chunks as usual. */
+static void vdagent_file_xfer_task_start_direct(
+    struct vdagent_file_xfers *xfers, AgentFileXferTask *task)
+{
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "file-xfer: failed to create pipe: %s",
+               strerror(errno));
+        return;
+    }
+#ifdef F_SETPIPE_SZ
+    /* Best effort, let vdagentd get a whole window ahead of us */
+    fcntl(fds[1], F_SETPIPE_SZ, VDAGENTD_FILE_XFER_WINDOW);
+#endif
+
+    if (udscs_write_fd(xfers->vdagentd, VDAGENTD_FILE_XFER_DIRECT, task->id,
+                       0, (uint8_t *)&task->file_size,
+                       sizeof(task->file_size), fds[1]) == 0)
+        task->pipe_fd = fds[0];
+    else
+        close(fds[0]);
+    close(fds[1]);
+}
+
 void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
     VDAgentFileXferStartMessage *msg)
 {
     AgentFileXferTask *task;
-    char *dir = NULL, *path = NULL, *file_path = NULL;
-    struct stat st;
-    int i;
+    char *dir = NULL, *file_path = NULL;
 
     g_return_if_fail(xfers != NULL);
 
@@ -199,32 +429,15 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
         goto error;
     }
 
-    path = g_strdup(file_path);
-    for (i = 0; i < 64 && (stat(path, &st) == 0 || errno != ENOENT); i++) {
-        g_free(path);
-        char *extension = strrchr(file_path, '.');
-        int basename_len = extension != NULL ? extension - file_path : strlen(file_path);
-        path = g_strdup_printf("%.*s (%i)%s", basename_len, file_path,
-                               i + 1, extension ? extension : "");
-    }
     g_free(task->file_name);
-    task->file_name = path;
-    if (i == 64) {
-        syslog(LOG_ERR, "file-xfer: more than 63 copies of %s exist?",
-               file_path);
-        goto error;
-    }
-
-    task->file_fd = open(path, O_CREAT | O_WRONLY, 0644);
-    if (task->file_fd == -1) {
-        syslog(LOG_ERR, "file-xfer: failed to create file %s: %s",
-               path, strerror(errno));
+    task->file_name = file_path;
+    file_path = NULL;
+    if (vdagent_file_xfer_task_create_file(task, dir) == -1)
         goto error;
-    }
 
     if (ftruncate(task->file_fd, task->file_size) < 0) {
         syslog(LOG_ERR, "file-xfer: err reserving %"PRIu64" bytes for %s: %s",
-               task->file_size, path, strerror(errno));
+               task->file_size, task->file_name, strerror(errno));
         goto error;
     }
 
@@ -232,10 +445,14 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
 
     if (xfers->debug)
         syslog(LOG_DEBUG, "file-xfer: Adding task %u %s %"PRIu64" bytes",
-               task->id, path, task->file_size);
+               task->id, task->file_name, task->file_size);
 
     udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
                 msg->id, VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA, NULL, 0);
+
+    /* vdagentd only takes it once it knows the xfer is ours */
+    if (task->file_size > 0 && !vdagent_file_xfer_task_is_compressed(task))
+        vdagent_file_xfer_task_start_direct(xfers, task);
     g_free(file_path);
     g_free(dir);
     return ;
@@ -271,11 +488,130 @@ void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
     }
 }
 
+/* All data has been written, make the file show up under its final name.
+   Return value: the VD_AGENT_FILE_XFER_STATUS to report to the client */
+static int vdagent_file_xfer_task_completed(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task)
+{
+    int last = g_hash_table_size(xfers->xfers) == 1;
+
+    if (xfers->sync == VDAGENT_FILE_XFERS_SYNC_FILE &&
+            fdatasync(task->file_fd) != 0) {
+        syslog(LOG_ERR, "file-xfer: error syncing %s: %s", task->file_name,
+               strerror(errno));
+        return VD_AGENT_FILE_XFER_STATUS_ERROR;
+    }
+    if (vdagent_file_xfer_task_link(xfers, task) != 0)
+        return VD_AGENT_FILE_XFER_STATUS_ERROR;
+    /* Flush all the files of a batch to disk in one go */
+    if (xfers->sync == VDAGENT_FILE_XFERS_SYNC_BATCH && last &&
+            syncfs(task->file_fd) != 0)
+        syslog(LOG_WARNING, "file-xfer: error syncing %s: %s",
+               task->file_name, strerror(errno));
+
+    if (xfers->debug)
+        syslog(LOG_DEBUG, "file-xfer: task %u %s has completed",
+               task->id, task->file_name);
+    close(task->file_fd);
+    task->file_fd = -1;
+    if (xfers->open_save_dir &&
+            task->file_xfer_nr == task->file_xfer_total && last) {
+        char buf[PATH_MAX];
+        snprintf(buf, PATH_MAX, "xdg-open '%s'&", xfers->save_dir);
+        if (system(buf) != 0)
+            syslog(LOG_WARNING, "file-xfer: failed to open %s",
+                   xfers->save_dir);
+    }
+    return VD_AGENT_FILE_XFER_STATUS_SUCCESS;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t size)
+{
+    ssize_t n;
+
+    while (size) {
+        n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* Write a chunk of received data to the file, decompressing it if needed.
+   Return value: 0 on success, -1 on error */
+static int vdagent_file_xfer_task_write(AgentFileXferTask *task,
+    const uint8_t *data, size_t size)
+{
+#ifdef HAVE_ZSTD
+    if (task->zstd) {
+        ZSTD_inBuffer in = { data, size, 0 };
+        ZSTD_outBuffer out;
+
+        do {
+            out.dst = task->zstd_buf;
+            out.size = task->zstd_buf_size;
+            out.pos = 0;
+            task->zstd_hint = ZSTD_decompressStream(task->zstd, &out, &in);
+            if (ZSTD_isError(task->zstd_hint)) {
+                syslog(LOG_ERR, "file-xfer: error decompressing %s: %s",
+                       task->file_name, ZSTD_getErrorName(task->zstd_hint));
+                return -1;
+            }
+            if (task->read_bytes + out.pos > task->file_size) {
+                syslog(LOG_ERR, "file-xfer: error received too much data");
+                return -1;
+            }
+            if (write_all(task->file_fd, out.dst, out.pos) != 0) {
+                syslog(LOG_ERR, "file-xfer: error writing %s: %s",
+                       task->file_name, strerror(errno));
+                return -1;
+            }
+            task->read_bytes += out.pos;
+            if (task->zstd_hint == 0 && in.pos < in.size) {
+                syslog(LOG_ERR, "file-xfer: error data past the end of the "
+                       "zstd frame of %s", task->file_name);
+                return -1;
+            }
+            /* 0 means the frame is fully flushed, going on would start
+               decoding a new frame */
+        } while (task->zstd_hint != 0 &&
+                 (in.pos < in.size || out.pos == out.size));
+        return 0;
+    }
+#endif
+
+    if (write_all(task->file_fd, data, size) != 0) {
+        syslog(LOG_ERR, "file-xfer: error writing %s: %s", task->file_name,
+               strerror(errno));
+        return -1;
+    }
+    task->read_bytes += size;
+    return 0;
+}
+
+/* Return value: whether all of the data of the file has been received,
+   the caller checks it matches the file size */
+static int vdagent_file_xfer_task_done(AgentFileXferTask *task)
+{
+#ifdef HAVE_ZSTD
+    /* Wait for the end of the frame, as it may carry a checksum. Nothing
+       comes after it, even if it decompressed to less than the file size */
+    if (task->zstd)
+        return task->zstd_hint == 0;
+#endif
+    return task->read_bytes >= task->file_size;
+}
+
 void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     VDAgentFileXferDataMessage *msg)
 {
     AgentFileXferTask *task;
-    int len, status = -1;
+    int status = -1;
 
     g_return_if_fail(xfers != NULL);
 
@@ -283,32 +619,18 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     if (!task)
         return;
 
-    len = write(task->file_fd, msg->data, msg->size);
-    if (len == msg->size) {
-        task->read_bytes += msg->size;
-        if (task->read_bytes >= task->file_size) {
+    if (vdagent_file_xfer_task_write(task, msg->data, msg->size) == 0) {
+        task->unacked_bytes += msg->size;
+        if (vdagent_file_xfer_task_done(task)) {
             if (task->read_bytes == task->file_size) {
-                if (xfers->debug)
-                    syslog(LOG_DEBUG, "file-xfer: task %u %s has completed",
-                           task->id, task->file_name);
-                close(task->file_fd);
-                task->file_fd = -1;
-                if (xfers->open_save_dir &&
-                        task->file_xfer_nr == task->file_xfer_total &&
-                        g_hash_table_size(xfers->xfers) == 1) {
-                    char buf[PATH_MAX];
-                    snprintf(buf, PATH_MAX, "xdg-open '%s'&", xfers->save_dir);
-                    status = system(buf);
-                }
-                status = VD_AGENT_FILE_XFER_STATUS_SUCCESS;
+                status = vdagent_file_xfer_task_completed(xfers, task);
             } else {
-                syslog(LOG_ERR, "file-xfer: error received too much data");
+                syslog(LOG_ERR, "file-xfer: error received too %s data",
+                       task->read_bytes < task->file_size ? "little" : "much");
                 status = VD_AGENT_FILE_XFER_STATUS_ERROR;
             }
         }
     } else {
-        syslog(LOG_ERR, "file-xfer: error writing %s: %s", task->file_name,
-               strerror(errno));
         status = VD_AGENT_FILE_XFER_STATUS_ERROR;
     }
 
@@ -316,6 +638,116 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
         udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
                     msg->id, status, NULL, 0);
         g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(msg->id));
+    } else if (task->unacked_bytes >= VDAGENTD_FILE_XFER_WINDOW / 4) {
+        /* Give vdagentd credit to send more data */
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_ACK,
+                    msg->id, task->unacked_bytes, NULL, 0);
+        task->unacked_bytes = 0;
+    }
+}
+
+void vdagent_file_xfers_direct(struct vdagent_file_xfers *xfers,
+    uint32_t id, int error)
+{
+    AgentFileXferTask *task;
+
+    g_return_if_fail(xfers != NULL);
+
+    task = vdagent_file_xfers_get_task(xfers, id);
+    if (!task)
+        return;
+
+    syslog(LOG_ERR, "file-xfer: vdagentd failed to pass on the data of %s: %s",
+           task->file_name, strerror(error));
+    udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS, id,
+                VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
+    g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(id));
+}
+
+int vdagent_file_xfers_fill_fds(struct vdagent_file_xfers *xfers,
+    fd_set *readfds)
+{
+    GHashTableIter iter;
+    gpointer value;
+    int nfds = -1;
+
+    g_return_val_if_fail(xfers != NULL, -1);
+
+    g_hash_table_iter_init(&iter, xfers->xfers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        AgentFileXferTask *task = value;
+
+        if (task->pipe_fd <= 0)
+            continue;
+        FD_SET(task->pipe_fd, readfds);
+        if (task->pipe_fd > nfds)
+            nfds = task->pipe_fd;
+    }
+
+    return nfds;
+}
+
+/* Move the data vdagentd wrote to the pipe to the file, without it going
+   through our memory unless the file system does not support splicing.
+   Return value: the VD_AGENT_FILE_XFER_STATUS to report once the xfer is
+   over, -1 otherwise */
+static int vdagent_file_xfer_task_splice(struct vdagent_file_xfers *xfers,
+    AgentFileXferTask *task)
+{
+    uint8_t buf[16384];
+    size_t len;
+    ssize_t n;
+
+    len = MIN(task->file_size - task->read_bytes, VDAGENTD_FILE_XFER_WINDOW);
+    n = splice(task->pipe_fd, NULL, task->file_fd, NULL, len,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EINVAL) {
+        n = read(task->pipe_fd, buf, MIN(len, sizeof(buf)));
+        if (n > 0 && write_all(task->file_fd, buf, n) != 0)
+            n = -1;
+    }
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return -1;
+        syslog(LOG_ERR, "file-xfer: error writing %s: %s", task->file_name,
+               strerror(errno));
+        return VD_AGENT_FILE_XFER_STATUS_ERROR;
+    }
+
+    if (n == 0) {
+        /* vdagentd stopped early, it or the client tell us why */
+        close(task->pipe_fd);
+        task->pipe_fd = -1;
+        return -1;
+    }
+
+    task->read_bytes += n;
+    if (task->read_bytes < task->file_size)
+        return -1;
+    return vdagent_file_xfer_task_completed(xfers, task);
+}
+
+void vdagent_file_xfers_handle_fds(struct vdagent_file_xfers *xfers,
+    fd_set *readfds)
+{
+    GHashTableIter iter;
+    gpointer value;
+    int status;
+
+    g_return_if_fail(xfers != NULL);
+
+    g_hash_table_iter_init(&iter, xfers->xfers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        AgentFileXferTask *task = value;
+
+        if (task->pipe_fd <= 0 || !FD_ISSET(task->pipe_fd, readfds))
+            continue;
+        status = vdagent_file_xfer_task_splice(xfers, task);
+        if (status != -1) {
+            udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
+                        task->id, status, NULL, 0);
+            g_hash_table_iter_remove(&iter);
+        }
     }
 }
 
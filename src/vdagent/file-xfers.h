@@ -22,13 +22,21 @@
 #ifndef __VDAGENT_FILE_XFERS_H
 #define __VDAGENT_FILE_XFERS_H
 
+#include <sys/select.h>
 #include "udscs.h"
 
 struct vdagent_file_xfers;
 
+/* When to flush the data of received files to disk */
+enum {
+    VDAGENT_FILE_XFERS_SYNC_NONE,  /* leave it to the kernel */
+    VDAGENT_FILE_XFERS_SYNC_FILE,  /* fdatasync() each file on completion */
+    VDAGENT_FILE_XFERS_SYNC_BATCH, /* syncfs() when no more xfers are pending */
+};
+
 struct vdagent_file_xfers *vdagent_file_xfers_create(
         struct udscs_connection *vdagentd, const char *save_dir,
-        int open_save_dir, int debug);
+        int open_save_dir, int sync, int debug);
 void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfer);
 
 void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
@@ -37,6 +45,15 @@ void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
     VDAgentFileXferStatusMessage *msg);
 void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     VDAgentFileXferDataMessage *msg);
+/* vdagentd failed to pass on the data of a direct xfer, error is an errno
+   value */
+void vdagent_file_xfers_direct(struct vdagent_file_xfers *xfers,
+    uint32_t id, int error);
+/* Direct xfers get their data through pipes, these watch them */
+int vdagent_file_xfers_fill_fds(struct vdagent_file_xfers *xfers,
+    fd_set *readfds);
+void vdagent_file_xfers_handle_fds(struct vdagent_file_xfers *xfers,
+    fd_set *readfds);
 void vdagent_file_xfers_error(struct udscs_connection *vdagentd,
     uint32_t msg_id);
 
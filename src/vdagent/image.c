@@ -0,0 +1,270 @@
+/*  image.c vdagent clipboard image conversion code
+
+    Copyright 2017 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <png.h>
+#include "image.h"
+
+/* BITMAPFILEHEADER + BITMAPINFOHEADER */
+#define BMP_HEADER_SIZE (14 + 40)
+
+/* The size of a PNG says nothing about the size of the image once decoded,
+   so limit what a client can make us allocate */
+#define BMP_MAX_SIZE (128 * 1024 * 1024)
+
+#define BI_RGB       0
+#define BI_BITFIELDS 3
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Extract the channel selected by mask from a pixel, scaled to 8 bits */
+static uint8_t get_channel(uint32_t pixel, uint32_t mask)
+{
+    uint32_t max;
+
+    if (!mask)
+        return 0xff;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        pixel >>= 1;
+    }
+    max = mask;
+    return ((pixel & mask) * 255 + max / 2) / max;
+}
+
+/* Convert 32 bpp BMP pixels to top-down RGBA, if the alpha channel is all
+   0 it is most likely unused, so treat the image as opaque then */
+static uint8_t *bmp_32bpp_to_rgba(const uint8_t *pixels, int width,
+                                  int height, int bottom_up,
+                                  const uint32_t masks[4])
+{
+    const uint8_t *src;
+    uint8_t *rgba, *dest;
+    uint32_t pixel, alpha = 0;
+    int x, y;
+
+    rgba = malloc((size_t)width * height * 4);
+    if (!rgba)
+        return NULL;
+
+    dest = rgba;
+    for (y = 0; y < height; y++) {
+        src = pixels + (size_t)(bottom_up ? height - 1 - y : y) * width * 4;
+        for (x = 0; x < width; x++) {
+            pixel = get_le32(src);
+            dest[0] = get_channel(pixel, masks[0]);
+            dest[1] = get_channel(pixel, masks[1]);
+            dest[2] = get_channel(pixel, masks[2]);
+            dest[3] = get_channel(pixel, masks[3]);
+            alpha |= dest[3];
+            src += 4;
+            dest += 4;
+        }
+    }
+
+    if (!alpha)
+        for (dest = rgba + 3; dest < rgba + (size_t)width * height * 4;
+             dest += 4)
+            *dest = 0xff;
+
+    return rgba;
+}
+
+uint8_t *vdagent_image_bmp_to_png(const uint8_t *bmp, uint32_t bmp_size,
+                                  uint32_t *png_size)
+{
+    uint32_t masks[4] = { 0x00ff0000, 0x0000ff00, 0x000000ff, 0 };
+    uint32_t offset, header_size, compression;
+    png_alloc_size_t size, alloc_size;
+    png_image image;
+    const uint8_t *pixels;
+    uint8_t *rgba = NULL, *png = NULL, *new_png;
+    int32_t width, height;
+    int bpp, stride, bottom_up;
+
+    if (bmp_size < BMP_HEADER_SIZE || bmp[0] != 'B' || bmp[1] != 'M') {
+        syslog(LOG_ERR, "bmp to png: not a bmp file");
+        return NULL;
+    }
+
+    offset = get_le32(bmp + 10);
+    header_size = get_le32(bmp + 14);
+    width = get_le32(bmp + 18);
+    height = get_le32(bmp + 22);
+    bpp = bmp[28] | (bmp[29] << 8);
+    compression = get_le32(bmp + 30);
+
+    if (header_size < 40 || width <= 0 || width > 65535 ||
+            height == 0 || height < -65535 || height > 65535) {
+        syslog(LOG_ERR, "bmp to png: invalid bmp header");
+        return NULL;
+    }
+    bottom_up = height > 0;
+    height = abs(height);
+
+    if (bpp == 32 && compression == BI_BITFIELDS) {
+        /* With a plain info header the masks follow it, with a v4 or v5
+           header they are part of it, either way they are at offset 54 */
+        if (bmp_size < BMP_HEADER_SIZE + 12 ||
+                (header_size >= 56 && bmp_size < BMP_HEADER_SIZE + 16)) {
+            syslog(LOG_ERR, "bmp to png: truncated bmp header");
+            return NULL;
+        }
+        masks[0] = get_le32(bmp + BMP_HEADER_SIZE);
+        masks[1] = get_le32(bmp + BMP_HEADER_SIZE + 4);
+        masks[2] = get_le32(bmp + BMP_HEADER_SIZE + 8);
+        if (header_size >= 56)
+            masks[3] = get_le32(bmp + BMP_HEADER_SIZE + 12);
+    } else if (compression != BI_RGB || (bpp != 24 && bpp != 32)) {
+        syslog(LOG_ERR, "bmp to png: unsupported bmp variant, "
+               "bpp %d compression %u", bpp, compression);
+        return NULL;
+    }
+
+    stride = ((width * (bpp / 8)) + 3) & ~3;
+    if (offset > bmp_size ||
+            (uint64_t)stride * height > bmp_size - offset) {
+        syslog(LOG_ERR, "bmp to png: truncated bmp data");
+        return NULL;
+    }
+    pixels = bmp + offset;
+
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    image.width = width;
+    image.height = height;
+    image.flags = PNG_IMAGE_FLAG_FAST;
+
+    if (bpp == 32) {
+        rgba = bmp_32bpp_to_rgba(pixels, width, height, bottom_up, masks);
+        if (!rgba) {
+            syslog(LOG_ERR, "bmp to png: out of memory");
+            return NULL;
+        }
+        image.format = PNG_FORMAT_RGBA;
+        pixels = rgba;
+        stride = width * 4;
+        bottom_up = 0;
+    } else {
+        /* 24 bpp rows can be passed to libpng as is */
+        image.format = PNG_FORMAT_BGR;
+    }
+
+    /* The PNG should be smaller than the BMP, but grow if it is not */
+    size = bmp_size;
+    while (1) {
+        new_png = realloc(png, size);
+        if (!new_png) {
+            syslog(LOG_ERR, "bmp to png: out of memory");
+            goto error;
+        }
+        png = new_png;
+        alloc_size = size;
+        if (png_image_write_to_memory(&image, png, &size, 0, pixels,
+                                      bottom_up ? -stride : stride, NULL))
+            break;
+        /* On failure size only grows if the buffer was too small */
+        if (size <= alloc_size || size > UINT32_MAX) {
+            syslog(LOG_ERR, "bmp to png: %s", image.message);
+            goto error;
+        }
+    }
+
+    free(rgba);
+    *png_size = size;
+    return png;
+
+error:
+    free(rgba);
+    free(png);
+    return NULL;
+}
+
+uint8_t *vdagent_image_png_to_bmp(const uint8_t *png, uint32_t png_size,
+                                  uint32_t *bmp_size)
+{
+    png_color background = { 0xff, 0xff, 0xff };
+    png_image image;
+    uint64_t size;
+    uint8_t *bmp;
+    uint32_t stride;
+
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&image, png, png_size)) {
+        syslog(LOG_ERR, "png to bmp: %s", image.message);
+        return NULL;
+    }
+    image.format = PNG_FORMAT_BGR;
+
+    stride = (image.width * 3 + 3) & ~3;
+    size = BMP_HEADER_SIZE + (uint64_t)stride * image.height;
+    if (image.width > 65535 || image.height > 65535 || size > BMP_MAX_SIZE) {
+        syslog(LOG_ERR, "png to bmp: image too large");
+        png_image_free(&image);
+        return NULL;
+    }
+
+    bmp = calloc(1, size);
+    if (!bmp) {
+        syslog(LOG_ERR, "png to bmp: out of memory");
+        png_image_free(&image);
+        return NULL;
+    }
+
+    /* BMP rows are stored bottom-up, hence the negative stride */
+    if (!png_image_finish_read(&image, &background, bmp + BMP_HEADER_SIZE,
+                               -(png_int_32)stride, NULL)) {
+        syslog(LOG_ERR, "png to bmp: %s", image.message);
+        free(bmp);
+        return NULL;
+    }
+
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    put_le32(bmp + 2, size);
+    put_le32(bmp + 10, BMP_HEADER_SIZE);
+    put_le32(bmp + 14, 40);
+    put_le32(bmp + 18, image.width);
+    put_le32(bmp + 22, image.height);
+    bmp[26] = 1;  /* planes */
+    bmp[28] = 24; /* bpp */
+    put_le32(bmp + 30, BI_RGB);
+    put_le32(bmp + 34, stride * image.height);
+
+    *bmp_size = size;
+    return bmp;
+}
@@ -0,0 +1,38 @@
+/*  image.h vdagent clipboard image conversion header
+
+    Copyright 2017 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENT_IMAGE_H
+#define __VDAGENT_IMAGE_H
+
+#include <stdint.h>
+
+/* Convert an uncompressed 24 or 32 bpp BMP file, as found on the clipboard,
+ * to PNG using a fast compression level.
+ * Return value: malloc-ed PNG data of *png_size bytes, or NULL on error.
+ */
+uint8_t *vdagent_image_bmp_to_png(const uint8_t *bmp, uint32_t bmp_size,
+                                  uint32_t *png_size);
+
+/* Convert a PNG image to a 24 bpp BMP file, compositing any transparency
+ * onto a white background. Images which would make a BMP larger than
+ * 128 MiB are rejected.
+ * Return value: malloc-ed BMP data of *bmp_size bytes, or NULL on error.
+ */
+uint8_t *vdagent_image_png_to_bmp(const uint8_t *png, uint32_t png_size,
+                                  uint32_t *bmp_size);
+
+#endif
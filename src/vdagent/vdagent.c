@@ -49,6 +49,8 @@ static const char *vdagentd_socket = VDAGENTD_SOCKET;
 static int debug = 0;
 static const char *fx_dir = NULL;
 static int fx_open_dir = -1;
+static int fx_sync = VDAGENT_FILE_XFERS_SYNC_NONE;
+static uint32_t clipboard_prefetch_size = 0;
 static struct vdagent_x11 *x11 = NULL;
 static struct vdagent_file_xfers *vdagent_file_xfers = NULL;
 static struct udscs_connection *client = NULL;
@@ -129,12 +131,21 @@ static void daemon_read_complete(struct udscs_connection **connp,
                                      ((VDAgentFileXferDataMessage *)data)->id);
         }
         break;
+    case VDAGENTD_FILE_XFER_DIRECT:
+        if (vdagent_file_xfers != NULL) {
+            vdagent_file_xfers_direct(vdagent_file_xfers, header->arg1,
+                                      header->arg2);
+        } else {
+            vdagent_file_xfers_error(*connp, header->arg1);
+        }
+        break;
     case VDAGENTD_CLIENT_DISCONNECTED:
         vdagent_x11_client_disconnected(x11);
         if (vdagent_file_xfers != NULL) {
             vdagent_file_xfers_destroy(vdagent_file_xfers);
             vdagent_file_xfers = vdagent_file_xfers_create(client, fx_dir,
-                                                           fx_open_dir, debug);
+                                                           fx_open_dir, fx_sync,
+                                                           debug);
         }
         break;
     default:
@@ -169,7 +180,10 @@ static void usage(FILE *fp)
       "  -S <filename>                     set udcs socket\n"
       "  -x                                don't daemonize\n"
       "  -f <dir|xdg-desktop|xdg-download> file xfer save dir\n"
-      "  -o <0|1>                          open dir on file xfer completion\n",
+      "  -o <0|1>                          open dir on file xfer completion\n"
+      "  -F <none|file|batch>              when to sync received files to disk\n"
+      "  -p <size>                         prefetch guest clipboard text up to\n"
+      "                                    <size> bytes (default 0: disabled)\n",
       VERSION);
 }
 
@@ -236,14 +250,14 @@ static int file_test(const char *path)
 int main(int argc, char *argv[])
 {
     fd_set readfds, writefds;
-    int c, n, nfds, x11_fd;
+    int c, n, nfds, x11_fd, monitors_fd;
     int do_daemonize = 1;
     int parent_socket = 0;
     int x11_sync = 0;
     struct sigaction act;
 
     for (;;) {
-        if (-1 == (c = getopt(argc, argv, "-dxhys:f:o:S:")))
+        if (-1 == (c = getopt(argc, argv, "-dxhys:f:o:F:S:p:")))
             break;
         switch (c) {
         case 'd':
@@ -267,9 +281,38 @@ int main(int argc, char *argv[])
         case 'o':
             fx_open_dir = atoi(optarg);
             break;
+        case 'F':
+            if (!strcmp(optarg, "none"))
+                fx_sync = VDAGENT_FILE_XFERS_SYNC_NONE;
+            else if (!strcmp(optarg, "file"))
+                fx_sync = VDAGENT_FILE_XFERS_SYNC_FILE;
+            else if (!strcmp(optarg, "batch"))
+                fx_sync = VDAGENT_FILE_XFERS_SYNC_BATCH;
+            else {
+                fprintf(stderr, "invalid file xfer sync mode: %s\n\n", optarg);
+                usage(stderr);
+                return 1;
+            }
+            break;
         case 'S':
             vdagentd_socket = optarg;
             break;
+        case 'p': {
+            unsigned long size;
+            char *end;
+
+            errno = 0;
+            size = strtoul(optarg, &end, 0);
+            if (errno || end == optarg || *end || optarg[0] == '-' ||
+                    size > UINT32_MAX) {
+                fprintf(stderr, "invalid clipboard prefetch size: %s\n\n",
+                        optarg);
+                usage(stderr);
+                return 1;
+            }
+            clipboard_prefetch_size = size;
+            break;
+        }
         default:
             fputs("\n", stderr);
             usage(stderr);
@@ -307,7 +350,8 @@ reconnect:
         return 1;
     }
 
-    x11 = vdagent_x11_create(client, debug, x11_sync);
+    x11 = vdagent_x11_create(client, debug, x11_sync,
+                             clipboard_prefetch_size);
     if (!x11) {
         udscs_destroy_connection(&client);
         return 1;
@@ -327,7 +371,8 @@ reconnect:
         fx_dir = g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD);
     if (fx_dir) {
         vdagent_file_xfers = vdagent_file_xfers_create(client, fx_dir,
-                                                       fx_open_dir, debug);
+                                                       fx_open_dir, fx_sync,
+                                                       debug);
     } else {
         syslog(LOG_WARNING,
                "warning could not get file xfer save dir, file transfers will be disabled");
@@ -350,6 +395,17 @@ reconnect:
         FD_SET(x11_fd, &readfds);
         if (x11_fd >= nfds)
             nfds = x11_fd + 1;
+        if (vdagent_file_xfers != NULL) {
+            n = vdagent_file_xfers_fill_fds(vdagent_file_xfers, &readfds);
+            if (n >= nfds)
+                nfds = n + 1;
+        }
+        monitors_fd = vdagent_x11_get_monitors_config_fd(x11);
+        if (monitors_fd != -1) {
+            FD_SET(monitors_fd, &readfds);
+            if (monitors_fd >= nfds)
+                nfds = monitors_fd + 1;
+        }
 
         n = select(nfds, &readfds, &writefds, NULL, NULL);
         if (n == -1) {
@@ -361,6 +417,10 @@ reconnect:
 
         if (FD_ISSET(x11_fd, &readfds))
             vdagent_x11_do_read(x11);
+        if (monitors_fd != -1 && FD_ISSET(monitors_fd, &readfds))
+            vdagent_x11_monitors_config_done(x11);
+        if (vdagent_file_xfers != NULL)
+            vdagent_file_xfers_handle_fds(vdagent_file_xfers, &readfds);
         udscs_client_handle_fds(&client, &readfds, &writefds);
     }
 
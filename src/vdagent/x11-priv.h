@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <glib.h>
 #include <spice/vd_agent.h>
 
 #include <X11/extensions/Xrandr.h>
@@ -29,32 +30,101 @@ enum { owner_none, owner_guest, owner_client };
 
 /* X11 terminology is confusing a selection request is a request from an
    app to get clipboard data from us, so iow from the spice client through
-   the vdagent channel. We handle these one at a time and queue any which
-   come in while we are still handling the current one. */
+   the vdagent channel. Requests which we can answer ourselves are answered
+   right away, the others wait for the client's data of the type they need.
+   Requests waiting for the same data share a single request to the client,
+   and each request does its own INCR transfer of large data, from a buffer
+   shared by all the requests answered with that data. */
+struct vdagent_x11_incr_data {
+    int refs;
+    uint32_t size;
+    uint8_t data[];
+};
+
+/* Requests beyond this many pending ones are refused right away, so that a
+   misbehaving app cannot make us queue (and buffer data for) any number */
+#define MAX_PENDING_SELECTION_REQUESTS 64
+
 struct vdagent_x11_selection_request {
     XEvent event;
     uint8_t selection;
+    /* Type of the client data we are waiting for, or
+       VD_AGENT_CLIPBOARD_NONE if the request is not waiting for data */
+    uint32_t type;
+    /* For MULTIPLE requests: the (target, property) pairs to convert, we
+       ask the client for the data of one type at a time */
+    Atom *multiple_pairs;
+    uint8_t *multiple_done;
+    int multiple_count;
+    /* INCR transfer state */
+    struct vdagent_x11_incr_data *data;
+    uint32_t data_pos;
+    Atom data_atom;
     struct vdagent_x11_selection_request *next;
 };
 
 /* A conversion request is X11 speak for asking another app to give its
    clipboard data to us, we do these on behalf of the spice client to copy
-   data from the guest to the client. Like selection requests we process
-   these one at a time. */
+   data from the guest to the client. We process these one at a time per
+   selection, see struct vdagent_x11_conversion_state. Besides requests from
+   the client there are requests we do for our own purposes, see the
+   purpose enum. */
+enum { conversion_client, conversion_dedup, conversion_prefetch };
+
 struct vdagent_x11_conversion_request {
     Atom target;
+    uint32_t type;
     uint8_t selection;
+    int purpose;
+    Time timestamp; /* Ownership timestamp we did the conversion for */
     struct vdagent_x11_conversion_request *next;
 };
 
+/* Conversion state of a selection. Conversions of different selections
+   use different properties on the selection_window, so that a slow owner
+   of one selection does not hold up conversions of the other. */
+struct vdagent_x11_conversion_state {
+    /* Pending requests, the first one is currently being processed */
+    struct vdagent_x11_conversion_request *req;
+    /* Property receiving the TARGETS of a new owner, data is received in
+       a property named after the selection itself */
+    Atom targets_prop;
+    /* Buffer for incr transfers */
+    int expect_property_notify;
+    int incr_discard; /* too large to prefetch, read it but drop the data */
+    uint8_t *data;
+    uint32_t data_size;
+    uint32_t data_space;
+    /* Set when a conversion was cancelled by an ownership change before
+       the owner answered it, so that its answer can be told apart from
+       the answer for the next conversion */
+    int stale_notify;
+    Time stale_timestamp;
+};
+
+/* Don't keep converted clipboard data bigger than this around */
+#define CLIPBOARD_CACHE_MAX_SIZE (16 * 1024 * 1024)
+
+/* The last data converted from the current owner of a selection for a type,
+   so that repeated client requests for it (ie by a clipboard manager) can
+   be answered without bothering the owner again. */
+struct vdagent_x11_clipboard_cache {
+    uint8_t *data;
+    uint32_t size;
+    Window owner;
+    Time timestamp;
+};
+
+#define CLIPBOARD_FORMAT_MAX_ATOMS 16
+
 struct clipboard_format_tmpl {
     uint32_t type;
-    const char *atom_names[16];
+    const char *atom_names[CLIPBOARD_FORMAT_MAX_ATOMS];
 };
 
 struct clipboard_format_info {
     uint32_t type;
-    Atom atoms[16];
+    Atom atoms[CLIPBOARD_FORMAT_MAX_ATOMS];
     int atom_count;
 };
 
@@ -63,6 +133,18 @@ struct monitor_size {
     int height;
 };
 
+/* Max number of the modes we created which are kept around per output */
+#define MODE_CACHE_SIZE 8
+
+/* A mode we created for an output, see xrandr_add_and_set() */
+struct mode_cache_entry {
+    RRMode id;
+    int width;     /* the size it was requested for, the mode itself */
+    int height;    /* may be a bit narrower */
+    int attached;  /* already added to the output */
+    unsigned int last_used;
+};
+
 static const struct clipboard_format_tmpl clipboard_format_templates[] = {
     { VD_AGENT_CLIPBOARD_UTF8_TEXT, { "UTF8_STRING", "text/plain;charset=UTF-8",
       "text/plain;charset=utf-8", "STRING", NULL }, },
@@ -75,14 +157,36 @@ static const struct clipboard_format_tmpl clipboard_format_templates[] = {
 
 #define clipboard_format_count (sizeof(clipboard_format_templates)/sizeof(clipboard_format_templates[0]))
 
+/* Max number of atom names to cache for debug messages */
+#define ATOM_NAME_CACHE_SIZE 1024
+
+/* Our TARGETS reply holds TARGETS itself and the atoms of all formats */
+#define CLIPBOARD_TARGETS_MAX (1 + clipboard_format_count * CLIPBOARD_FORMAT_MAX_ATOMS)
+
+/* What we last told the client about a guest owned selection: the types
+   from our last grab, and a hash of the last data it got from us */
+struct vdagent_x11_clipboard_sent {
+    int type_count;
+    uint32_t types[clipboard_format_count];
+    uint32_t data_type; /* VD_AGENT_CLIPBOARD_NONE if no data was sent */
+    uint32_t data_size;
+    uint64_t data_hash;
+};
+
 struct vdagent_x11 {
     struct clipboard_format_info clipboard_formats[clipboard_format_count];
+    /* Maps the atoms of the clipboard_formats to their format index and
+       preference, see vdagent_x11_lookup_target() */
+    GHashTable *clipboard_target_index;
+    /* Names of atoms for debug messages, see vdagent_x11_get_atom_name() */
+    GHashTable *atom_names;
     Display *display;
     Atom clipboard_atom;
     Atom clipboard_primary_atom;
     Atom targets_atom;
     Atom incr_atom;
     Atom multiple_atom;
+    Atom atom_pair_atom;
     Atom timestamp_atom;
     Window root_window[MAX_SCREENS];
     Window selection_window;
@@ -99,32 +203,47 @@ struct vdagent_x11 {
     int max_prop_size;
     int expected_targets_notifies[256];
     int clipboard_owner[256];
+    /* Owner window and XFixes timestamp of the guest selection owners */
+    Window selection_owner[256];
+    Time selection_timestamp[256];
+    struct vdagent_x11_clipboard_cache clipboard_cache[256][clipboard_format_count];
+    struct vdagent_x11_clipboard_sent clipboard_sent[256];
+    /* Set while the client still holds the grab of a previous guest owner,
+       which we may be able to keep using for the current owner */
+    int clipboard_regrab_pending[256];
+    unsigned int clipboard_dedup_hits;
+    unsigned int clipboard_dedup_misses;
+    /* Type we offer on top of the ones the owner offers, by converting
+       images on the fly, see vdagent_x11_add_converted_type() */
+    uint32_t clipboard_converted_type[256];
+    uint64_t clipboard_png_bytes_saved;
+    /* Max size of text to prefetch from new guest owners, 0 to disable */
+    uint32_t clipboard_prefetch_size;
     int clipboard_type_count[256];
     uint32_t clipboard_agent_types[256][256];
     Atom clipboard_x11_targets[256][256];
-    /* Data for conversion_req which is currently being processed */
-    struct vdagent_x11_conversion_request *conversion_req;
-    int expect_property_notify;
-    uint8_t *clipboard_data;
-    uint32_t clipboard_data_size;
-    uint32_t clipboard_data_space;
-    /* Data for selection_req which is currently being processed */
+    /* Our TARGETS reply while we own a selection on behalf of the client */
+    Atom clipboard_targets_reply[256][CLIPBOARD_TARGETS_MAX];
+    int clipboard_targets_reply_count[256];
+    struct vdagent_x11_conversion_state conversion[256];
+    /* Selection requests which are still being processed */
     struct vdagent_x11_selection_request *selection_req;
-    uint8_t *selection_req_data;
-    uint32_t selection_req_data_pos;
-    uint32_t selection_req_data_size;
-    Atom selection_req_atom;
     /* resolution change state */
     struct {
+        /* Kept up to date from RandR events, see update_randr_res() */
         XRRScreenResources *res;
         XRROutputInfo **outputs;
         XRRCrtcInfo **crtcs;
+        int res_dirty; /* res needs to be queried again */
         int min_width;
         int max_width;
         int min_height;
         int max_height;
         int num_monitors;
         struct monitor_size monitor_sizes[MONITOR_SIZE_COUNT];
+        struct mode_cache_entry mode_cache[MONITOR_SIZE_COUNT][MODE_CACHE_SIZE];
+        int mode_cache_count[MONITOR_SIZE_COUNT];
+        unsigned int mode_cache_clock;
         VDAgentMonitorsConfig *failed_conf;
     } randr;
 
@@ -136,20 +255,33 @@ struct vdagent_x11 {
     int xrandr_minor;
     int has_xinerama;
     int dont_send_guest_xorg_res;
-};
+    /* What we last told the daemon, see send_daemon_guest_xorg_res() */
+    struct vdagentd_guest_xorg_resolution *guest_xorg_res;
+    int guest_xorg_res_count;
+    int guest_xorg_res_width;
+    int guest_xorg_res_height;
+
+    /* Applies the monitors configs, see x11-randr.c */
+    struct vdagent_x11_randr_worker *randr_worker;
+    int is_randr_worker; /* This is the worker's own vdagent_x11 */
 
-extern int (*vdagent_x11_prev_error_handler)(Display *, XErrorEvent *);
-extern int vdagent_x11_caught_error;
+    /* See vdagent_x11_set_error_handler() */
+    int (*error_handler)(struct vdagent_x11 *x11, XErrorEvent *error);
+    int caught_error;
+};
 
 void vdagent_x11_randr_init(struct vdagent_x11 *x11);
+void vdagent_x11_randr_destroy(struct vdagent_x11 *x11);
 void vdagent_x11_send_daemon_guest_xorg_res(struct vdagent_x11 *x11,
                                             int update);
 void vdagent_x11_randr_handle_root_size_change(struct vdagent_x11 *x11,
                                             int screen, int width, int height);
 int vdagent_x11_randr_handle_event(struct vdagent_x11 *x11,
     XEvent event);
+void vdagent_x11_register_display(struct vdagent_x11 *x11);
+void vdagent_x11_unregister_display(struct vdagent_x11 *x11);
 void vdagent_x11_set_error_handler(struct vdagent_x11 *x11,
-    int (*handler)(Display *, XErrorEvent *));
+    int (*handler)(struct vdagent_x11 *, XErrorEvent *));
 int vdagent_x11_restore_error_handler(struct vdagent_x11 *x11);
 
 #endif // VDAGENT_X11_PRIV
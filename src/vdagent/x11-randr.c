@@ -27,8 +27,13 @@
 #include <syslog.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 
+#include <X11/Xlib-xcb.h>
 #include <X11/extensions/Xinerama.h>
+#include <xcb/randr.h>
 
 #include "vdagentd-proto.h"
 #include "x11.h"
@@ -36,9 +41,11 @@
 
 #define MM_PER_INCH (25.4)
 
-static int error_handler(Display *display, XErrorEvent *error)
+static void randr_worker_start(struct vdagent_x11 *x11);
+
+static int error_handler(struct vdagent_x11 *x11, XErrorEvent *error)
 {
-    vdagent_x11_caught_error = 1;
+    x11->caught_error = 1;
     return 0;
 }
 
@@ -75,52 +82,612 @@ static void free_randr_resources(struct vdagent_x11 *x11)
     }
     if (x11->randr.outputs != NULL) {
         for (i = 0 ; i < x11->randr.res->noutput; ++i) {
-            XRRFreeOutputInfo(x11->randr.outputs[i]);
+            free(x11->randr.outputs[i]);
         }
         free(x11->randr.outputs);
     }
     if (x11->randr.crtcs != NULL) {
         for (i = 0 ; i < x11->randr.res->ncrtc; ++i) {
-            XRRFreeCrtcInfo(x11->randr.crtcs[i]);
+            free(x11->randr.crtcs[i]);
         }
         free(x11->randr.crtcs);
     }
-    XRRFreeScreenResources(x11->randr.res);
+    free(x11->randr.res);
     x11->randr.res = NULL;
     x11->randr.outputs = NULL;
     x11->randr.crtcs = NULL;
     x11->randr.num_monitors = 0;
 }
 
+static int output_index_from_id(struct vdagent_x11 *x11, RROutput id)
+{
+    int i;
+
+    for (i = 0 ; i < x11->randr.res->noutput ; ++i) {
+        if (id == x11->randr.res->outputs[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int crtc_index_from_id(struct vdagent_x11 *x11, RRCrtc id)
+{
+    int i;
+
+    for (i = 0 ; i < x11->randr.res->ncrtc ; ++i) {
+        if (id == x11->randr.res->crtcs[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * We query RandR through XCB, so that the requests for all outputs and crtcs
+ * can be sent at once and a full update takes 2 round trips, rather than one
+ * per output and crtc. The replies are stored in the structs Xlib uses, so
+ * that they can be passed to the Xlib RandR functions we use to make
+ * changes. Like Xlib we allocate each as a single block, freed with free().
+ */
+static XRRScreenResources *randr_res_new(xcb_timestamp_t timestamp,
+    xcb_timestamp_t config_timestamp,
+    const xcb_randr_crtc_t *crtcs, int ncrtc,
+    const xcb_randr_output_t *outputs, int noutput,
+    const xcb_randr_mode_info_t *modes, int nmode, const uint8_t *names)
+{
+    XRRScreenResources *res;
+    XRRModeInfo *mode;
+    char *name;
+    int i, names_size = 0;
+
+    for (i = 0 ; i < nmode; ++i)
+        names_size += modes[i].name_len + 1;
+
+    res = malloc(sizeof(*res) + nmode * sizeof(XRRModeInfo) +
+                 ncrtc * sizeof(RRCrtc) + noutput * sizeof(RROutput) +
+                 names_size);
+    if (!res)
+        return NULL;
+
+    res->timestamp = timestamp;
+    res->configTimestamp = config_timestamp;
+    res->nmode = nmode;
+    res->modes = (XRRModeInfo *)(res + 1);
+    res->ncrtc = ncrtc;
+    res->crtcs = (RRCrtc *)(res->modes + nmode);
+    res->noutput = noutput;
+    res->outputs = (RROutput *)(res->crtcs + ncrtc);
+    name = (char *)(res->outputs + noutput);
+
+    for (i = 0 ; i < ncrtc; ++i)
+        res->crtcs[i] = crtcs[i];
+    for (i = 0 ; i < noutput; ++i)
+        res->outputs[i] = outputs[i];
+    for (i = 0 ; i < nmode; ++i) {
+        mode = &res->modes[i];
+        mode->id         = modes[i].id;
+        mode->width      = modes[i].width;
+        mode->height     = modes[i].height;
+        mode->dotClock   = modes[i].dot_clock;
+        mode->hSyncStart = modes[i].hsync_start;
+        mode->hSyncEnd   = modes[i].hsync_end;
+        mode->hTotal     = modes[i].htotal;
+        mode->hSkew      = modes[i].hskew;
+        mode->vSyncStart = modes[i].vsync_start;
+        mode->vSyncEnd   = modes[i].vsync_end;
+        mode->vTotal     = modes[i].vtotal;
+        mode->modeFlags  = modes[i].mode_flags;
+        mode->nameLength = modes[i].name_len;
+        mode->name       = name;
+        memcpy(name, names, mode->nameLength);
+        name[mode->nameLength] = '\0';
+        names += mode->nameLength;
+        name += mode->nameLength + 1;
+    }
+    return res;
+}
+
+static XRROutputInfo *randr_output_info_new(
+    xcb_randr_get_output_info_reply_t *reply)
+{
+    XRROutputInfo *info;
+    xcb_randr_crtc_t *crtcs;
+    xcb_randr_output_t *clones;
+    xcb_randr_mode_t *modes;
+    int i;
+
+    info = malloc(sizeof(*info) + reply->num_crtcs * sizeof(RRCrtc) +
+                  reply->num_clones * sizeof(RROutput) +
+                  reply->num_modes * sizeof(RRMode) + reply->name_len + 1);
+    if (!info)
+        return NULL;
+
+    info->timestamp      = reply->timestamp;
+    info->crtc           = reply->crtc;
+    info->mm_width       = reply->mm_width;
+    info->mm_height      = reply->mm_height;
+    info->connection     = reply->connection;
+    info->subpixel_order = reply->subpixel_order;
+    info->ncrtc          = reply->num_crtcs;
+    info->crtcs          = (RRCrtc *)(info + 1);
+    info->nclone         = reply->num_clones;
+    info->clones         = (RROutput *)(info->crtcs + info->ncrtc);
+    info->nmode          = reply->num_modes;
+    info->npreferred     = reply->num_preferred;
+    info->modes          = (RRMode *)(info->clones + info->nclone);
+    info->nameLen        = reply->name_len;
+    info->name           = (char *)(info->modes + info->nmode);
+
+    crtcs = xcb_randr_get_output_info_crtcs(reply);
+    for (i = 0 ; i < info->ncrtc; ++i)
+        info->crtcs[i] = crtcs[i];
+    clones = xcb_randr_get_output_info_clones(reply);
+    for (i = 0 ; i < info->nclone; ++i)
+        info->clones[i] = clones[i];
+    modes = xcb_randr_get_output_info_modes(reply);
+    for (i = 0 ; i < info->nmode; ++i)
+        info->modes[i] = modes[i];
+    memcpy(info->name, xcb_randr_get_output_info_name(reply), info->nameLen);
+    info->name[info->nameLen] = '\0';
+    return info;
+}
+
+static XRRCrtcInfo *randr_crtc_info_new(xcb_randr_get_crtc_info_reply_t *reply)
+{
+    XRRCrtcInfo *info;
+    xcb_randr_output_t *outputs;
+    int i;
+
+    /* Leave room for an output even if the crtc is disabled, so that
+       crtc_set_config() can record the one it drives */
+    info = malloc(sizeof(*info) +
+                  (MAX(reply->num_outputs, 1) + reply->num_possible_outputs) *
+                  sizeof(RROutput));
+    if (!info)
+        return NULL;
+
+    info->timestamp = reply->timestamp;
+    info->x         = reply->x;
+    info->y         = reply->y;
+    info->width     = reply->width;
+    info->height    = reply->height;
+    info->mode      = reply->mode;
+    info->rotation  = reply->rotation;
+    info->rotations = reply->rotations;
+    info->npossible = reply->num_possible_outputs;
+    info->possible  = (RROutput *)(info + 1);
+    info->noutput   = reply->num_outputs;
+    info->outputs   = info->possible + info->npossible;
+
+    outputs = xcb_randr_get_crtc_info_outputs(reply);
+    for (i = 0 ; i < info->noutput; ++i)
+        info->outputs[i] = outputs[i];
+    outputs = xcb_randr_get_crtc_info_possible(reply);
+    for (i = 0 ; i < info->npossible; ++i)
+        info->possible[i] = outputs[i];
+    return info;
+}
+
+/* Collect the reply for an output info request, on errors we return a
+   disconnected output, so that the rest of the code need not check */
+static XRROutputInfo *randr_output_info_reply(struct vdagent_x11 *x11,
+    xcb_randr_get_output_info_cookie_t cookie)
+{
+    xcb_randr_get_output_info_reply_t *reply;
+    XRROutputInfo *info = NULL;
+
+    reply = xcb_randr_get_output_info_reply(XGetXCBConnection(x11->display),
+                                            cookie, NULL);
+    if (reply) {
+        info = randr_output_info_new(reply);
+        free(reply);
+    }
+    if (!info) {
+        syslog(LOG_ERR, "update_randr_res: RRGetOutputInfo failed");
+        x11->randr.res_dirty = 1;
+        info = calloc(1, sizeof(*info));
+        if (info)
+            info->connection = RR_Disconnected;
+    }
+    return info;
+}
+
+static XRRCrtcInfo *randr_crtc_info_reply(struct vdagent_x11 *x11,
+    xcb_randr_get_crtc_info_cookie_t cookie)
+{
+    xcb_randr_get_crtc_info_reply_t *reply;
+    XRRCrtcInfo *info = NULL;
+
+    reply = xcb_randr_get_crtc_info_reply(XGetXCBConnection(x11->display),
+                                          cookie, NULL);
+    if (reply) {
+        info = randr_crtc_info_new(reply);
+        free(reply);
+    }
+    if (!info) {
+        syslog(LOG_ERR, "update_randr_res: RRGetCrtcInfo failed");
+        x11->randr.res_dirty = 1;
+        info = calloc(1, sizeof(*info));
+    }
+    return info;
+}
+
+static XRRScreenResources *randr_get_screen_resources(struct vdagent_x11 *x11,
+    int poll)
+{
+    xcb_connection_t *conn = XGetXCBConnection(x11->display);
+    XRRScreenResources *res = NULL;
+
+    if (poll) {
+        xcb_randr_get_screen_resources_reply_t *reply;
+
+        reply = xcb_randr_get_screen_resources_reply(conn,
+                    xcb_randr_get_screen_resources(conn, x11->root_window[0]),
+                    NULL);
+        if (reply) {
+            res = randr_res_new(reply->timestamp, reply->config_timestamp,
+                        xcb_randr_get_screen_resources_crtcs(reply),
+                        reply->num_crtcs,
+                        xcb_randr_get_screen_resources_outputs(reply),
+                        reply->num_outputs,
+                        xcb_randr_get_screen_resources_modes(reply),
+                        reply->num_modes,
+                        xcb_randr_get_screen_resources_names(reply));
+            free(reply);
+        }
+    } else {
+        xcb_randr_get_screen_resources_current_reply_t *reply;
+
+        reply = xcb_randr_get_screen_resources_current_reply(conn,
+                    xcb_randr_get_screen_resources_current(conn,
+                                                      x11->root_window[0]),
+                    NULL);
+        if (reply) {
+            res = randr_res_new(reply->timestamp, reply->config_timestamp,
+                        xcb_randr_get_screen_resources_current_crtcs(reply),
+                        reply->num_crtcs,
+                        xcb_randr_get_screen_resources_current_outputs(reply),
+                        reply->num_outputs,
+                        xcb_randr_get_screen_resources_current_modes(reply),
+                        reply->num_modes,
+                        xcb_randr_get_screen_resources_current_names(reply));
+            free(reply);
+        }
+    }
+
+    if (!res) {
+        /* Continue with no outputs and try again next time */
+        syslog(LOG_ERR, "update_randr_res: RRGetScreenResources failed");
+        x11->randr.res_dirty = 1;
+        res = randr_res_new(0, 0, NULL, 0, NULL, 0, NULL, 0, NULL);
+    }
+    return res;
+}
+
+static int output_has_mode(struct vdagent_x11 *x11, int output, RRMode id)
+{
+    XRROutputInfo *output_info = x11->randr.outputs[output];
+    int m;
+
+    for (m = 0 ; m < output_info->nmode; ++m) {
+        if (output_info->modes[m] == id)
+            return 1;
+    }
+    return 0;
+}
+
+static void mode_cache_remove(struct vdagent_x11 *x11, int output, int i)
+{
+    x11->randr.mode_cache_count[output]--;
+    memmove(&x11->randr.mode_cache[output][i],
+            &x11->randr.mode_cache[output][i + 1],
+            (x11->randr.mode_cache_count[output] - i) *
+            sizeof(struct mode_cache_entry));
+}
+
+/* Drop the cached modes which got destroyed behind our back, and check
+   which ones are still added to their output */
+static void mode_cache_sync(struct vdagent_x11 *x11)
+{
+    struct mode_cache_entry *entry;
+    int i, output;
+
+    for (output = 0; output < MONITOR_SIZE_COUNT; output++) {
+        if (output >= x11->randr.res->noutput) {
+            x11->randr.mode_cache_count[output] = 0;
+            continue;
+        }
+        for (i = x11->randr.mode_cache_count[output] - 1; i >= 0; i--) {
+            entry = &x11->randr.mode_cache[output][i];
+            if (!mode_from_id(x11, entry->id))
+                mode_cache_remove(x11, output, i);
+            else
+                entry->attached = output_has_mode(x11, output, entry->id);
+        }
+    }
+}
+
+/*
+ * Our copy of the RandR resources is kept up to date from RRCrtcChangeNotify
+ * and RROutputChangeNotify events, and by applying the changes we make
+ * ourselves, see update_randr_res_from_event(), crtc_set_config() and
+ * forget_mode(). Only when that is not possible, i.e. when modes got
+ * created or the outputs changed, res_dirty gets set and update_randr_res()
+ * queries everything again.
+ */
 static void update_randr_res(struct vdagent_x11 *x11, int poll)
 {
+    xcb_connection_t *conn = XGetXCBConnection(x11->display);
+    xcb_randr_get_screen_size_range_cookie_t size_range_cookie;
+    xcb_randr_get_screen_size_range_reply_t *size_range;
+    xcb_randr_get_output_info_cookie_t *output_cookies;
+    xcb_randr_get_crtc_info_cookie_t *crtc_cookies;
+    XRRScreenResources *res;
     int i;
 
+    if (x11->randr.res && !x11->randr.res_dirty && !poll)
+        return;
+
     free_randr_resources(x11);
-    if (poll)
-        x11->randr.res = XRRGetScreenResources(x11->display, x11->root_window[0]);
-    else
-        x11->randr.res = XRRGetScreenResourcesCurrent(x11->display, x11->root_window[0]);
-    x11->randr.outputs = malloc(x11->randr.res->noutput * sizeof(*x11->randr.outputs));
-    x11->randr.crtcs = malloc(x11->randr.res->ncrtc * sizeof(*x11->randr.crtcs));
-    for (i = 0 ; i < x11->randr.res->noutput; ++i) {
-        x11->randr.outputs[i] = XRRGetOutputInfo(x11->display, x11->randr.res,
-                                                 x11->randr.res->outputs[i]);
+    x11->randr.res_dirty = 0;
+
+    /* Make sure the server has seen the requests Xlib may still buffer */
+    XFlush(x11->display);
+
+    /* This only changes with the outputs, so only get it here */
+    size_range_cookie = xcb_randr_get_screen_size_range(conn,
+                                                        x11->root_window[0]);
+    res = x11->randr.res = randr_get_screen_resources(x11, poll);
+    x11->randr.outputs = calloc(res->noutput, sizeof(*x11->randr.outputs));
+    x11->randr.crtcs = calloc(res->ncrtc, sizeof(*x11->randr.crtcs));
+    output_cookies = g_new(xcb_randr_get_output_info_cookie_t, res->noutput);
+    crtc_cookies = g_new(xcb_randr_get_crtc_info_cookie_t, res->ncrtc);
+
+    /* Send all requests, and only then wait for the replies */
+    for (i = 0 ; i < res->noutput; ++i)
+        output_cookies[i] = xcb_randr_get_output_info(conn, res->outputs[i],
+                                                      res->configTimestamp);
+    for (i = 0 ; i < res->ncrtc; ++i)
+        crtc_cookies[i] = xcb_randr_get_crtc_info(conn, res->crtcs[i],
+                                                  res->configTimestamp);
+
+    for (i = 0 ; i < res->noutput; ++i) {
+        x11->randr.outputs[i] = randr_output_info_reply(x11, output_cookies[i]);
         if (x11->randr.outputs[i]->connection == RR_Connected)
             x11->randr.num_monitors++;
     }
-    for (i = 0 ; i < x11->randr.res->ncrtc; ++i) {
-        x11->randr.crtcs[i] = XRRGetCrtcInfo(x11->display, x11->randr.res,
-                                             x11->randr.res->crtcs[i]);
-    }
-    /* XXX is this dynamic? should it be cached? */
-    if (XRRGetScreenSizeRange(x11->display, x11->root_window[0],
-                              &x11->randr.min_width,
-                              &x11->randr.min_height,
-                              &x11->randr.max_width,
-                              &x11->randr.max_height) != 1) {
+    for (i = 0 ; i < res->ncrtc; ++i)
+        x11->randr.crtcs[i] = randr_crtc_info_reply(x11, crtc_cookies[i]);
+
+    size_range = xcb_randr_get_screen_size_range_reply(conn, size_range_cookie,
+                                                       NULL);
+    if (size_range) {
+        x11->randr.min_width  = size_range->min_width;
+        x11->randr.min_height = size_range->min_height;
+        x11->randr.max_width  = size_range->max_width;
+        x11->randr.max_height = size_range->max_height;
+        free(size_range);
+    } else {
         syslog(LOG_ERR, "update_randr_res: RRGetScreenSizeRange failed");
     }
+
+    g_free(output_cookies);
+    g_free(crtc_cookies);
+
+    mode_cache_sync(x11);
+}
+
+static void update_randr_res_from_event(struct vdagent_x11 *x11,
+                                        XRRNotifyEvent *event)
+{
+    XRRCrtcChangeNotifyEvent *cce;
+    XRROutputChangeNotifyEvent *oce;
+    XRROutputInfo *output_info;
+    XRRCrtcInfo *crtc;
+    int i;
+
+    if (!x11->randr.res || x11->randr.res_dirty)
+        return; /* Everything gets queried again anyway */
+
+    switch (event->subtype) {
+    case RRNotify_CrtcChange:
+        cce = (XRRCrtcChangeNotifyEvent *)event;
+        i = crtc_index_from_id(x11, cce->crtc);
+        if (i == -1) {
+            x11->randr.res_dirty = 1;
+            break;
+        }
+        crtc = x11->randr.crtcs[i];
+        crtc->mode     = cce->mode;
+        crtc->rotation = cce->rotation;
+        crtc->x        = cce->x;
+        crtc->y        = cce->y;
+        crtc->width    = cce->width;
+        crtc->height   = cce->height;
+        /* The mode may have been created by others, or by our worker */
+        if (cce->mode != None && !mode_from_id(x11, cce->mode))
+            x11->randr.res_dirty = 1;
+        /* The event does not tell which outputs the crtc drives */
+        if (cce->mode == None)
+            crtc->noutput = 0;
+        else if (crtc->noutput == 0)
+            x11->randr.res_dirty = 1;
+        break;
+    case RRNotify_OutputChange:
+        /* The event does not tell us about the modes of the output */
+        oce = (XRROutputChangeNotifyEvent *)event;
+        i = output_index_from_id(x11, oce->output);
+        if (i == -1) {
+            x11->randr.res_dirty = 1;
+            break;
+        }
+        output_info = randr_output_info_reply(x11,
+            xcb_randr_get_output_info(XGetXCBConnection(x11->display),
+                                       oce->output,
+                                       x11->randr.res->configTimestamp));
+        if (!output_info)
+            break;
+        if (x11->randr.outputs[i]->connection == RR_Connected)
+            x11->randr.num_monitors--;
+        if (output_info->connection == RR_Connected)
+            x11->randr.num_monitors++;
+        free(x11->randr.outputs[i]);
+        x11->randr.outputs[i] = output_info;
+        break;
+    default:
+        x11->randr.res_dirty = 1;
+        break;
+    }
+}
+
+/* Update our copy of a crtc after successfully configuring it, like
+   everywhere else the crtc and the output it drives share their index */
+static void crtc_set_config(struct vdagent_x11 *x11, int crtc_index,
+                            XRRModeInfo *mode, int x, int y)
+{
+    XRRCrtcInfo *crtc = x11->randr.crtcs[crtc_index];
+
+    crtc->mode   = mode ? mode->id : None;
+    crtc->x      = x;
+    crtc->y      = y;
+    crtc->width  = mode ? mode->width : 0;
+    crtc->height = mode ? mode->height : 0;
+    if (!mode) {
+        crtc->noutput = 0;
+    } else if (crtc->outputs) {
+        crtc->noutput = 1;
+        crtc->outputs[0] = x11->randr.res->outputs[crtc_index];
+    } else {
+        /* Placeholder for a crtc we failed to query */
+        x11->randr.res_dirty = 1;
+    }
+}
+
+/* Whether the output's crtc already shows it with the given geometry,
+   width and height 0 meaning disabled */
+static int crtc_has_config(struct vdagent_x11 *x11, int output,
+                           int x, int y, int width, int height)
+{
+    XRRCrtcInfo *crtc;
+
+    if (output >= x11->randr.res->ncrtc)
+        return 0;
+    crtc = x11->randr.crtcs[output];
+    if (width == 0 || height == 0)
+        return crtc->mode == None;
+
+    return crtc->mode != None && crtc->noutput == 1 &&
+           crtc->outputs[0] == x11->randr.res->outputs[output] &&
+           crtc->x == x && crtc->y == y &&
+           crtc->width == width && crtc->height == height;
+}
+
+/* Remove a mode we destroyed from our copy of the resources */
+static void forget_mode(struct vdagent_x11 *x11, RRMode id)
+{
+    XRRScreenResources *res = x11->randr.res;
+    XRROutputInfo *output_info;
+    int i, m;
+
+    for (m = 0 ; m < res->nmode; ++m) {
+        if (res->modes[m].id == id) {
+            res->nmode--;
+            memmove(&res->modes[m], &res->modes[m + 1],
+                    (res->nmode - m) * sizeof(*res->modes));
+            break;
+        }
+    }
+
+    for (i = 0 ; i < res->noutput; ++i) {
+        output_info = x11->randr.outputs[i];
+        for (m = 0 ; m < output_info->nmode; ++m) {
+            if (output_info->modes[m] == id) {
+                output_info->nmode--;
+                memmove(&output_info->modes[m], &output_info->modes[m + 1],
+                        (output_info->nmode - m) * sizeof(RRMode));
+                if (m < output_info->npreferred)
+                    output_info->npreferred--;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * The modes we create for an output are kept around after switching it to
+ * another size, so that going back to a size does not require creating a
+ * mode, which means querying all the resources again. Once an output has
+ * MODE_CACHE_SIZE of them, the least recently used one which is not in use
+ * gets destroyed to make room for a new one.
+ */
+static struct mode_cache_entry *mode_cache_lookup(struct vdagent_x11 *x11,
+    int output, int width, int height)
+{
+    struct mode_cache_entry *entry;
+    int i;
+
+    for (i = 0 ; i < x11->randr.mode_cache_count[output]; ++i) {
+        entry = &x11->randr.mode_cache[output][i];
+        if (entry->width == width && entry->height == height) {
+            entry->last_used = ++x11->randr.mode_cache_clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void mode_cache_make_room(struct vdagent_x11 *x11, int output)
+{
+    struct mode_cache_entry *entry;
+    RRMode current = None;
+    int i, lru = -1;
+
+    if (x11->randr.mode_cache_count[output] < MODE_CACHE_SIZE)
+        return;
+
+    if (output < x11->randr.res->ncrtc)
+        current = x11->randr.crtcs[output]->mode;
+    for (i = 0 ; i < x11->randr.mode_cache_count[output]; ++i) {
+        entry = &x11->randr.mode_cache[output][i];
+        if (entry->id != current && (lru == -1 ||
+                entry->last_used < x11->randr.mode_cache[output][lru].last_used))
+            lru = i;
+    }
+    if (lru == -1)
+        return;
+
+    entry = &x11->randr.mode_cache[output][lru];
+    if (x11->debug)
+        syslog(LOG_DEBUG, "Deleting mode %dx%d-%d", entry->width,
+               entry->height, output);
+    vdagent_x11_set_error_handler(x11, error_handler);
+    if (entry->attached)
+        XRRDeleteOutputMode(x11->display, x11->randr.res->outputs[output],
+                            entry->id);
+    XRRDestroyMode(x11->display, entry->id);
+    // ignore race error, if mode is deleted by others
+    vdagent_x11_restore_error_handler(x11);
+    forget_mode(x11, entry->id);
+    mode_cache_remove(x11, output, lru);
+}
+
+/* The caller must have called mode_cache_make_room() first */
+static struct mode_cache_entry *mode_cache_add(struct vdagent_x11 *x11,
+    int output, XRRModeInfo *mode, int width, int height)
+{
+    struct mode_cache_entry *entry;
+
+    if (x11->randr.mode_cache_count[output] >= MODE_CACHE_SIZE)
+        return NULL;
+
+    entry = &x11->randr.mode_cache[output][x11->randr.mode_cache_count[output]++];
+    entry->id = mode->id;
+    entry->width = width;
+    entry->height = height;
+    entry->attached = output_has_mode(x11, output, mode->id);
+    entry->last_used = ++x11->randr.mode_cache_clock;
+    return entry;
 }
 
 void vdagent_x11_randr_init(struct vdagent_x11 *x11)
@@ -140,10 +707,12 @@ void vdagent_x11_randr_init(struct vdagent_x11 *x11)
     }
 
     XRRSelectInput(x11->display, x11->root_window[0],
-        RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+        RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask |
+        RROutputChangeNotifyMask);
 
     if (x11->has_xrandr) {
         update_randr_res(x11, 0);
+        randr_worker_start(x11);
     } else {
         x11->randr.res = NULL;
     }
@@ -201,45 +770,6 @@ find_mode_by_size (struct vdagent_x11 *x11, int output, int width, int height)
     return ret;
 }
 
-static void delete_mode(struct vdagent_x11 *x11, int output_index,
-                        int width, int height)
-{
-    int m;
-    XRRModeInfo *mode;
-    XRROutputInfo *output_info;
-    char name[20];
-
-    if (width == 0 || height == 0)
-        return;
-
-    snprintf(name, sizeof(name), "%dx%d-%d", width, height, output_index);
-    if (x11->debug)
-        syslog(LOG_DEBUG, "Deleting mode %s", name);
-
-    output_info = x11->randr.outputs[output_index];
-    if (output_info->ncrtc != 1) {
-        syslog(LOG_ERR, "output has %d crtcs, expected exactly 1, "
-               "failed to delete mode", output_info->ncrtc);
-        return;
-    }
-    for (m = 0 ; m < x11->randr.res->nmode; ++m) {
-        mode = &x11->randr.res->modes[m];
-        if (strcmp(mode->name, name) == 0)
-            break;
-    }
-    if (m < x11->randr.res->nmode) {
-        vdagent_x11_set_error_handler(x11, error_handler);
-        XRRDeleteOutputMode (x11->display, x11->randr.res->outputs[output_index],
-                             mode->id);
-        XRRDestroyMode (x11->display, mode->id);
-	// ignore race error, if mode is created by others
-	vdagent_x11_restore_error_handler(x11);
-    }
-
-    /* silly to update every time for more than one monitor */
-    update_randr_res(x11, 0);
-}
-
 static void set_reduced_cvt_mode(XRRModeInfo *mode, int width, int height)
 {
     /* Code taken from hw/xfree86/modes/xf86cvt.c
@@ -333,7 +863,8 @@ static XRRModeInfo *create_new_mode(struct vdagent_x11 *x11, int output_index,
     // ignore race error, if mode is created by others
     vdagent_x11_restore_error_handler(x11);
 
-    /* silly to update every time for more than one monitor */
+    /* We need the new mode's info, which we only get by querying again */
+    x11->randr.res_dirty = 1;
     update_randr_res(x11, 0);
 
     return find_mode_by_name(x11, modename);
@@ -342,12 +873,11 @@ static XRRModeInfo *create_new_mode(struct vdagent_x11 *x11, int output_index,
 static int xrandr_add_and_set(struct vdagent_x11 *x11, int output, int x, int y,
                               int width, int height)
 {
-    XRRModeInfo *mode;
+    struct mode_cache_entry *entry;
+    XRRModeInfo *mode = NULL;
     int xid;
     Status s;
     RROutput outputs[1];
-    int old_width  = x11->randr.monitor_sizes[output].width;
-    int old_height = x11->randr.monitor_sizes[output].height;
 
     if (!x11->randr.res || output >= x11->randr.res->noutput || output < 0) {
         syslog(LOG_ERR, "%s: program error: missing RANDR or bad output",
@@ -359,15 +889,30 @@ static int xrandr_add_and_set(struct vdagent_x11 *x11, int output, int x, int y,
         return 0;
     }
     xid = x11->randr.res->outputs[output];
-    mode = find_mode_by_size(x11, output, width, height);
+    entry = mode_cache_lookup(x11, output, width, height);
+    if (entry) {
+        mode = mode_from_id(x11, entry->id);
+        if (!mode) {
+            mode_cache_remove(x11, output, entry - x11->randr.mode_cache[output]);
+            entry = NULL;
+        }
+    }
+    if (!mode)
+        mode = find_mode_by_size(x11, output, width, height);
     if (!mode) {
+        mode_cache_make_room(x11, output);
         mode = create_new_mode(x11, output, width, height);
+        if (mode)
+            entry = mode_cache_add(x11, output, mode, width, height);
     }
     if (!mode) {
         syslog(LOG_ERR, "failed to add a new mode");
         return 0;
     }
-    XRRAddOutputMode(x11->display, xid, mode->id);
+    if (entry && !entry->attached) {
+        XRRAddOutputMode(x11->display, xid, mode->id);
+        entry->attached = 1;
+    }
     x11->randr.monitor_sizes[output].width = width;
     x11->randr.monitor_sizes[output].height = height;
     outputs[0] = xid;
@@ -380,10 +925,7 @@ static int xrandr_add_and_set(struct vdagent_x11 *x11, int output, int x, int y,
         x11->set_crtc_config_not_functional = 1;
         return 0;
     }
-
-    /* clean the previous name, if any */
-    if (width != old_width || height != old_height)
-        delete_mode(x11, output, old_width, old_height);
+    crtc_set_config(x11, output, mode, x, y);
 
     return 1;
 }
@@ -398,6 +940,9 @@ static void xrandr_disable_output(struct vdagent_x11 *x11, int output)
         return;
     }
 
+    if (crtc_has_config(x11, output, 0, 0, 0, 0))
+        goto done; /* Already disabled */
+
     s = XRRSetCrtcConfig(x11->display, x11->randr.res,
                          x11->randr.res->crtcs[output],
                          CurrentTime, 0, 0, None, RR_Rotate_0,
@@ -405,9 +950,11 @@ static void xrandr_disable_output(struct vdagent_x11 *x11, int output)
 
     if (s != RRSetConfigSuccess)
         syslog(LOG_ERR, "failed to disable monitor");
+    else
+        crtc_set_config(x11, output, NULL, 0, 0);
 
-    delete_mode(x11, output, x11->randr.monitor_sizes[output].width,
-                             x11->randr.monitor_sizes[output].height);
+done:
+    /* Keep the mode around, the output will likely be enabled again */
     x11->randr.monitor_sizes[output].width  = 0;
     x11->randr.monitor_sizes[output].height = 0;
 }
@@ -496,11 +1043,16 @@ int vdagent_x11_randr_handle_event(struct vdagent_x11 *x11,
         case RRScreenChangeNotify: {
             XRRScreenChangeNotifyEvent *sce =
                 (XRRScreenChangeNotifyEvent *) &event;
+            /* The config timestamp changes when outputs come and go */
+            if (x11->randr.res &&
+                    sce->config_timestamp != x11->randr.res->configTimestamp)
+                x11->randr.res_dirty = 1;
             vdagent_x11_randr_handle_root_size_change(x11, 0,
                 sce->width, sce->height);
             break;
         }
         case RRNotify: {
+            update_randr_res_from_event(x11, (XRRNotifyEvent *) &event);
             update_randr_res(x11, 0);
             if (!x11->dont_send_guest_xorg_res)
                 vdagent_x11_send_daemon_guest_xorg_res(x11, 1);
@@ -710,20 +1262,46 @@ static void dump_monitors_config(struct vdagent_x11 *x11,
     }
 }
 
+/* Process the pending events of our connection, the worker only needs to
+   handle the RandR and root window ones */
+static void randr_do_read(struct vdagent_x11 *x11)
+{
+    XEvent event;
+
+    if (!x11->is_randr_worker) {
+        vdagent_x11_do_read(x11);
+        return;
+    }
+
+    while (XPending(x11->display)) {
+        XNextEvent(x11->display, &event);
+        if (vdagent_x11_randr_handle_event(x11, event))
+            continue;
+        if (event.type == ConfigureNotify &&
+                event.xconfigure.window == x11->root_window[0])
+            vdagent_x11_randr_handle_root_size_change(x11, 0,
+                event.xconfigure.width, event.xconfigure.height);
+    }
+}
+
 /*
  * Set monitor configuration according to client request.
  *
  * On exit send current configuration to client, regardless of error.
+ * Unless this runs in the worker, then the main thread does so once
+ * it is done.
  *
  * Errors:
  *  screen size too large for driver to handle. (we set the largest/smallest possible)
  *  no randr support in X server.
  *  invalid configuration request from client.
  */
-void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
-                                    VDAgentMonitorsConfig *mon_config,
-                                    int fallback)
+static void randr_set_monitor_config(struct vdagent_x11 *x11,
+                                     VDAgentMonitorsConfig *mon_config,
+                                     int fallback)
 {
+    int dont_send_guest_xorg_res;
+    int grab;
     int primary_w, primary_h;
     int i, real_num_of_monitors = 0;
     VDAgentMonitorsConfig *curr = NULL;
@@ -746,6 +1324,10 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
     }
     mon_config->num_of_monitors = real_num_of_monitors;
 
+    /* Bring our copy of the RandR resources up to date with the changes
+       made by others, one round trip instead of querying everything */
+    XSync(x11->display, False);
+    randr_do_read(x11);
     update_randr_res(x11, 0);
     if (mon_config->num_of_monitors > x11->randr.res->noutput) {
         syslog(LOG_WARNING,
@@ -785,6 +1367,17 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
     g_unlink(config);
     g_free(config);
 
+    /* Apply the whole config with the server grabbed so that clients only
+     * get to see and react to the final state, not the intermediate ones.
+     * Only the crtcs whose configuration changes get touched.
+     * But not from the worker: the grab would stall the main thread's
+     * connection for as long as the driver takes, see
+     * vdagent_x11_randr_worker.
+     */
+    grab = !x11->is_randr_worker;
+    if (grab)
+        XGrabServer(x11->display);
+
     for (i = mon_config->num_of_monitors; i < x11->randr.res->noutput; i++)
         xrandr_disable_output(x11, i);
 
@@ -834,8 +1427,10 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
         if (vdagent_x11_restore_error_handler(x11)) {
             syslog(LOG_ERR, "XRRSetScreenSize failed, not enough mem?");
             if (!fallback) {
+                if (grab)
+                    XUngrabServer(x11->display);
                 syslog(LOG_WARNING, "Restoring previous config");
-                vdagent_x11_set_monitor_config(x11, curr, 1);
+                randr_set_monitor_config(x11, curr, 1);
                 free(curr);
                 /* Remember this config failed, if the client is maximized or
                    fullscreen it will keep sending the failing config. */
@@ -864,6 +1459,11 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
         height = mon_config->monitors[i].height;
         x = mon_config->monitors[i].x;
         y = mon_config->monitors[i].y;
+        if (crtc_has_config(x11, i, x, y, width, height)) {
+            if (x11->debug)
+                syslog(LOG_DEBUG, "Monitor %d unchanged", i);
+            continue;
+        }
         if (!xrandr_add_and_set(x11, i, x, y, width, height) &&
                 enabled_monitors(mon_config) == 1) {
             set_screen_to_best_size(x11, width, height,
@@ -871,6 +1471,8 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
             break;
         }
     }
+    if (grab)
+        XUngrabServer(x11->display);
 
     update_randr_res(x11,
         x11->randr.num_monitors != enabled_monitors(mon_config));
@@ -878,18 +1480,257 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
     x11->height[0] = primary_h;
 
     /* Flush output buffers and consume any pending events (ConfigureNotify) */
+    dont_send_guest_xorg_res = x11->dont_send_guest_xorg_res;
     x11->dont_send_guest_xorg_res = 1;
-    vdagent_x11_do_read(x11);
-    x11->dont_send_guest_xorg_res = 0;
+    randr_do_read(x11);
+    x11->dont_send_guest_xorg_res = dont_send_guest_xorg_res;
 
 exit:
-    vdagent_x11_send_daemon_guest_xorg_res(x11, 0);
+    if (!x11->is_randr_worker)
+        vdagent_x11_send_daemon_guest_xorg_res(x11, 0);
 
     /* Flush output buffers and consume any pending events */
-    vdagent_x11_do_read(x11);
+    randr_do_read(x11);
     free(curr);
 }
 
+/*
+ * Some drivers take hundreds of milliseconds to apply a monitors config,
+ * so we do that in a worker thread with its own connection to the X server
+ * and vdagent_x11 struct, so that the clipboard and everything else keeps
+ * working in the meantime. The main thread only hands it the configs to
+ * apply, if several come in while it is busy only the last one gets
+ * applied, and once done it writes to done_pipe so that the main thread
+ * tells the daemon about the resulting resolution.
+ */
+struct vdagent_x11_randr_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct vdagent_x11 *x11;
+    VDAgentMonitorsConfig *next_config;
+    int applying;
+    int quit;
+    int done_pipe[2];
+};
+
+static struct vdagent_x11 *randr_worker_x11_create(struct vdagent_x11 *x11)
+{
+    struct vdagent_x11 *wx11;
+    XWindowAttributes attrib;
+    int i;
+
+    wx11 = calloc(1, sizeof(*wx11));
+    if (!wx11)
+        return NULL;
+
+    wx11->display = XOpenDisplay(NULL);
+    if (!wx11->display) {
+        free(wx11);
+        return NULL;
+    }
+    vdagent_x11_register_display(wx11);
+
+    wx11->is_randr_worker = 1;
+    wx11->debug = x11->debug;
+    wx11->screen_count = 1;
+    wx11->root_window[0] = RootWindow(wx11->display, 0);
+    wx11->fd = ConnectionNumber(wx11->display);
+    wx11->has_xrandr = x11->has_xrandr;
+    wx11->xrandr_major = x11->xrandr_major;
+    wx11->xrandr_minor = x11->xrandr_minor;
+    wx11->has_xinerama = x11->has_xinerama;
+    /* The main thread is the one talking to the daemon */
+    wx11->dont_send_guest_xorg_res = 1;
+
+    XRRQueryExtension(wx11->display, &wx11->xrandr_event_base, &i);
+    XRRSelectInput(wx11->display, wx11->root_window[0],
+        RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask |
+        RROutputChangeNotifyMask);
+    XSelectInput(wx11->display, wx11->root_window[0], StructureNotifyMask);
+    XGetWindowAttributes(wx11->display, wx11->root_window[0], &attrib);
+    wx11->width[0]  = attrib.width;
+    wx11->height[0] = attrib.height;
+    update_randr_res(wx11, 0);
+
+    return wx11;
+}
+
+static void randr_worker_x11_destroy(struct vdagent_x11 *wx11)
+{
+    free_randr_resources(wx11);
+    free(wx11->randr.failed_conf);
+    vdagent_x11_unregister_display(wx11);
+    XCloseDisplay(wx11->display);
+    free(wx11);
+}
+
+static void *randr_worker_main(void *data)
+{
+    struct vdagent_x11_randr_worker *worker = data;
+    VDAgentMonitorsConfig *mon_config;
+
+    pthread_mutex_lock(&worker->lock);
+    while (1) {
+        while (!worker->next_config && !worker->quit)
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        if (worker->quit)
+            break;
+
+        mon_config = worker->next_config;
+        worker->next_config = NULL;
+        worker->applying = 1;
+        pthread_mutex_unlock(&worker->lock);
+
+        randr_set_monitor_config(worker->x11, mon_config, 0);
+        free(mon_config);
+
+        pthread_mutex_lock(&worker->lock);
+        worker->applying = 0;
+        if (write(worker->done_pipe[1], "", 1) != 1)
+            syslog(LOG_ERR, "error notifying the monitors config completion");
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+static void randr_worker_start(struct vdagent_x11 *x11)
+{
+    struct vdagent_x11_randr_worker *worker;
+
+    worker = calloc(1, sizeof(*worker));
+    if (!worker)
+        goto error;
+    worker->done_pipe[0] = worker->done_pipe[1] = -1;
+
+    worker->x11 = randr_worker_x11_create(x11);
+    if (!worker->x11)
+        goto error;
+
+    if (pipe(worker->done_pipe))
+        goto error;
+    fcntl(worker->done_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(worker->done_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(worker->done_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    if (pthread_create(&worker->thread, NULL, randr_worker_main, worker)) {
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->cond);
+        goto error;
+    }
+
+    x11->randr_worker = worker;
+    return;
+
+error:
+    syslog(LOG_WARNING, "could not start the monitors config thread, "
+           "applying monitors configs synchronously");
+    if (worker) {
+        if (worker->x11)
+            randr_worker_x11_destroy(worker->x11);
+        if (worker->done_pipe[0] != -1) {
+            close(worker->done_pipe[0]);
+            close(worker->done_pipe[1]);
+        }
+        free(worker);
+    }
+}
+
+void vdagent_x11_randr_destroy(struct vdagent_x11 *x11)
+{
+    struct vdagent_x11_randr_worker *worker = x11->randr_worker;
+
+    if (!worker)
+        return;
+
+    /* This waits for the config being applied, if any */
+    pthread_mutex_lock(&worker->lock);
+    worker->quit = 1;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->cond);
+    free(worker->next_config);
+    randr_worker_x11_destroy(worker->x11);
+    close(worker->done_pipe[0]);
+    close(worker->done_pipe[1]);
+    free(worker);
+    x11->randr_worker = NULL;
+}
+
+void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
+                                    VDAgentMonitorsConfig *mon_config,
+                                    int fallback)
+{
+    struct vdagent_x11_randr_worker *worker = x11->randr_worker;
+    VDAgentMonitorsConfig *next_config;
+
+    if (!worker) {
+        randr_set_monitor_config(x11, mon_config, fallback);
+        return;
+    }
+
+    next_config = malloc(config_size(mon_config->num_of_monitors));
+    if (!next_config) {
+        syslog(LOG_ERR, "out of memory allocating monitors config");
+        goto exit;
+    }
+    memcpy(next_config, mon_config, config_size(mon_config->num_of_monitors));
+
+    /* Only tell the daemon about the resolution once the worker is done */
+    x11->dont_send_guest_xorg_res = 1;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->next_config && x11->debug)
+        syslog(LOG_DEBUG, "dropping monitors config superseded before "
+               "being applied");
+    free(worker->next_config);
+    worker->next_config = next_config;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+
+exit:
+    /* Flush output buffers and consume any pending events */
+    vdagent_x11_do_read(x11);
+}
+
+int vdagent_x11_get_monitors_config_fd(struct vdagent_x11 *x11)
+{
+    return x11->randr_worker ? x11->randr_worker->done_pipe[0] : -1;
+}
+
+void vdagent_x11_monitors_config_done(struct vdagent_x11 *x11)
+{
+    struct vdagent_x11_randr_worker *worker = x11->randr_worker;
+    char buf[16];
+    int busy;
+
+    if (!worker)
+        return;
+
+    while (read(worker->done_pipe[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&worker->lock);
+    busy = worker->applying || worker->next_config;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (!busy) {
+        /* Process the events caused by the worker's changes first */
+        XSync(x11->display, False);
+        vdagent_x11_do_read(x11);
+        x11->dont_send_guest_xorg_res = 0;
+        vdagent_x11_send_daemon_guest_xorg_res(x11, 1);
+    }
+
+    /* Flush output buffers and consume any pending events */
+    vdagent_x11_do_read(x11);
+}
+
 void vdagent_x11_send_daemon_guest_xorg_res(struct vdagent_x11 *x11, int update)
 {
     struct vdagentd_guest_xorg_resolution *res = NULL;
@@ -966,6 +1807,15 @@ no_info:
         }
     }
 
+    /* Many events lead here, only tell the daemon about actual changes */
+    if (x11->guest_xorg_res && width == x11->guest_xorg_res_width &&
+            height == x11->guest_xorg_res_height &&
+            screen_count == x11->guest_xorg_res_count &&
+            memcmp(res, x11->guest_xorg_res, screen_count * sizeof(*res)) == 0) {
+        free(res);
+        return;
+    }
+
     if (x11->debug) {
         for (i = 0; i < screen_count; i++)
             syslog(LOG_DEBUG, "Screen %d %dx%d%+d%+d", i, res[i].width,
@@ -974,7 +1824,11 @@ no_info:
 
     udscs_write(x11->vdagentd, VDAGENTD_GUEST_XORG_RESOLUTION, width, height,
                 (uint8_t *)res, screen_count * sizeof(*res));
-    free(res);
+    free(x11->guest_xorg_res);
+    x11->guest_xorg_res = res;
+    x11->guest_xorg_res_count = screen_count;
+    x11->guest_xorg_res_width = width;
+    x11->guest_xorg_res_height = height;
     return;
 no_mem:
     syslog(LOG_ERR, "out of memory while trying to send resolutions, not sending resolutions.");
@@ -33,10 +33,12 @@
 
 #include <glib.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <string.h>
 #include <syslog.h>
 #include <assert.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
@@ -44,14 +46,23 @@
 #include "vdagentd-proto.h"
 #include "x11.h"
 #include "x11-priv.h"
-
-/* Stupid X11 API, there goes our encapsulate all data in a struct design */
-int (*vdagent_x11_prev_error_handler)(Display *, XErrorEvent *);
-int vdagent_x11_caught_error;
+#ifdef HAVE_LIBPNG
+#include "image.h"
+#endif
+
+/* Stupid X11 API, there goes our encapsulate all data in a struct design.
+   The error handler is process wide while the monitors configs get applied
+   from another thread with its own display, see x11-randr.c. So we install
+   a single handler which passes the errors on to the vdagent_x11 of the
+   display they happened on. */
+static int (*vdagent_x11_prev_error_handler)(Display *, XErrorEvent *);
+static GSList *vdagent_x11_displays;
+static pthread_mutex_t vdagent_x11_displays_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
                                                 XEvent *event, int incr);
-static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11);
+static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11,
+                struct vdagent_x11_selection_request *req);
 static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
                                               XEvent *event);
 static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
@@ -83,20 +94,66 @@ static int vdagent_x11_debug_error_handler(
 /* With the clipboard we're sometimes dealing with Properties on another apps
    Window. which can go away at any time. */
 static int vdagent_x11_ignore_bad_window_handler(
-    Display *display, XErrorEvent *error)
+    struct vdagent_x11 *x11, XErrorEvent *error)
 {
     if (error->error_code == BadWindow)
         return 0;
 
+    return vdagent_x11_prev_error_handler(x11->display, error);
+}
+
+static int vdagent_x11_error_handler(Display *display, XErrorEvent *error)
+{
+    struct vdagent_x11 *x11 = NULL;
+    GSList *l;
+
+    /* Only held for the lookup, this runs with the display locked */
+    pthread_mutex_lock(&vdagent_x11_displays_lock);
+    for (l = vdagent_x11_displays; l; l = l->next) {
+        if (((struct vdagent_x11 *)l->data)->display == display) {
+            x11 = l->data;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&vdagent_x11_displays_lock);
+
+    if (x11 && x11->error_handler)
+        return x11->error_handler(x11, error);
+
     return vdagent_x11_prev_error_handler(display, error);
 }
 
+void vdagent_x11_register_display(struct vdagent_x11 *x11)
+{
+    /* Displays only come and go from the main thread, while no other
+       thread uses Xlib */
+    if (!vdagent_x11_displays)
+        vdagent_x11_prev_error_handler =
+            XSetErrorHandler(vdagent_x11_error_handler);
+
+    pthread_mutex_lock(&vdagent_x11_displays_lock);
+    vdagent_x11_displays = g_slist_prepend(vdagent_x11_displays, x11);
+    pthread_mutex_unlock(&vdagent_x11_displays_lock);
+}
+
+void vdagent_x11_unregister_display(struct vdagent_x11 *x11)
+{
+    pthread_mutex_lock(&vdagent_x11_displays_lock);
+    vdagent_x11_displays = g_slist_remove(vdagent_x11_displays, x11);
+    pthread_mutex_unlock(&vdagent_x11_displays_lock);
+
+    if (!vdagent_x11_displays)
+        XSetErrorHandler(vdagent_x11_prev_error_handler);
+}
+
+/* Only affects the errors of x11->display, no lock is held in between so
+   the other display can keep going */
 void vdagent_x11_set_error_handler(struct vdagent_x11 *x11,
-    int (*handler)(Display *, XErrorEvent *))
+    int (*handler)(struct vdagent_x11 *, XErrorEvent *))
 {
     XSync(x11->display, False);
-    vdagent_x11_caught_error = 0;
-    vdagent_x11_prev_error_handler = XSetErrorHandler(handler);
+    x11->caught_error = 0;
+    x11->error_handler = handler;
 }
 
 int vdagent_x11_restore_error_handler(struct vdagent_x11 *x11)
@@ -104,9 +161,9 @@ int vdagent_x11_restore_error_handler(struct vdagent_x11 *x11)
     int error;
 
     XSync(x11->display, False);
-    XSetErrorHandler(vdagent_x11_prev_error_handler);
-    error = vdagent_x11_caught_error;
-    vdagent_x11_caught_error = 0;
+    x11->error_handler = NULL;
+    error = x11->caught_error;
+    x11->caught_error = 0;
 
     return error;
 }
@@ -173,8 +230,80 @@ static void vdagent_x11_get_wm_name(struct vdagent_x11 *x11)
     vdagent_x11_restore_error_handler(x11);
 }
 
+static void vdagent_x11_add_atom_name(struct vdagent_x11 *x11, Atom a,
+    const char *name)
+{
+    g_hash_table_insert(x11->atom_names, GUINT_TO_POINTER(a), g_strdup(name));
+}
+
+/* Seed the atom name cache with the atoms we know the names of */
+static void vdagent_x11_seed_atom_names(struct vdagent_x11 *x11)
+{
+    int i, j;
+
+    vdagent_x11_add_atom_name(x11, x11->clipboard_atom, "CLIPBOARD");
+    vdagent_x11_add_atom_name(x11, x11->clipboard_primary_atom, "PRIMARY");
+    vdagent_x11_add_atom_name(x11, x11->targets_atom, "TARGETS");
+    vdagent_x11_add_atom_name(x11, x11->incr_atom, "INCR");
+    vdagent_x11_add_atom_name(x11, x11->multiple_atom, "MULTIPLE");
+    vdagent_x11_add_atom_name(x11, x11->atom_pair_atom, "ATOM_PAIR");
+    vdagent_x11_add_atom_name(x11, x11->timestamp_atom, "TIMESTAMP");
+    vdagent_x11_add_atom_name(x11, XA_ATOM, "ATOM");
+    for (i = 0; i < clipboard_format_count; i++)
+        for (j = 0; j < x11->clipboard_formats[i].atom_count; j++)
+            vdagent_x11_add_atom_name(x11, x11->clipboard_formats[i].atoms[j],
+                                  clipboard_format_templates[i].atom_names[j]);
+}
+
+/* Fetch the names of the atoms missing from the cache in one round trip */
+static void vdagent_x11_cache_atom_names(struct vdagent_x11 *x11,
+    Atom *atoms, int count)
+{
+    Atom *missing;
+    char **names;
+    int i, missing_count = 0;
+
+    missing = g_new(Atom, count);
+    for (i = 0; i < count; i++)
+        if (atoms[i] != None &&
+                !g_hash_table_contains(x11->atom_names,
+                                       GUINT_TO_POINTER(atoms[i])))
+            missing[missing_count++] = atoms[i];
+
+    if (missing_count) {
+        names = g_new0(char *, missing_count);
+        /* On failure the names of the valid atoms are still returned */
+        XGetAtomNames(x11->display, missing, missing_count, names);
+        for (i = 0; i < missing_count; i++) {
+            if (names[i]) {
+                vdagent_x11_add_atom_name(x11, missing[i], names[i]);
+                XFree(names[i]);
+            }
+        }
+        g_free(names);
+    }
+    g_free(missing);
+}
+
+/* The returned string is owned by the cache, which is only pruned from
+   vdagent_x11_do_read(), so it stays valid while handling an event */
+static const char *vdagent_x11_get_atom_name(struct vdagent_x11 *x11, Atom a)
+{
+    const char *name;
+
+    if (a == None)
+        return "None";
+
+    name = g_hash_table_lookup(x11->atom_names, GUINT_TO_POINTER(a));
+    if (!name) {
+        vdagent_x11_cache_atom_names(x11, &a, 1);
+        name = g_hash_table_lookup(x11->atom_names, GUINT_TO_POINTER(a));
+    }
+    return name ? name : "(invalid atom)";
+}
+
 struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
-    int debug, int sync)
+    int debug, int sync, uint32_t clipboard_prefetch_size)
 {
     struct vdagent_x11 *x11;
     XWindowAttributes attrib;
@@ -188,7 +317,10 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
 
     x11->vdagentd = vdagentd;
     x11->debug = debug;
+    x11->clipboard_prefetch_size = clipboard_prefetch_size;
 
+    /* We use a second display from another thread, see x11-randr.c */
+    XInitThreads();
     x11->display = XOpenDisplay(NULL);
     if (!x11->display) {
         syslog(LOG_ERR, "could not connect to X-server");
@@ -209,6 +341,7 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
         XSetErrorHandler(vdagent_x11_debug_error_handler);
         XSynchronize(x11->display, True);
     }
+    vdagent_x11_register_display(x11);
 
     for (i = 0; i < x11->screen_count; i++)
         x11->root_window[i] = RootWindow(x11->display, i);
@@ -218,7 +351,14 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
     x11->targets_atom = XInternAtom(x11->display, "TARGETS", False);
     x11->incr_atom = XInternAtom(x11->display, "INCR", False);
     x11->multiple_atom = XInternAtom(x11->display, "MULTIPLE", False);
+    x11->atom_pair_atom = XInternAtom(x11->display, "ATOM_PAIR", False);
     x11->timestamp_atom = XInternAtom(x11->display, "TIMESTAMP", False);
+    x11->clipboard_target_index = g_hash_table_new(g_direct_hash,
+                                                   g_direct_equal);
+    x11->conversion[VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD].targets_prop =
+        XInternAtom(x11->display, "SPICE_VDAGENT_CLIPBOARD_TARGETS", False);
+    x11->conversion[VD_AGENT_CLIPBOARD_SELECTION_PRIMARY].targets_prop =
+        XInternAtom(x11->display, "SPICE_VDAGENT_PRIMARY_TARGETS", False);
     for(i = 0; i < clipboard_format_count; i++) {
         x11->clipboard_formats[i].type = clipboard_format_templates[i].type;
         for(j = 0; clipboard_format_templates[i].atom_names[j]; j++) {
@@ -226,9 +366,16 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
                 XInternAtom(x11->display,
                             clipboard_format_templates[i].atom_names[j],
                             False);
+            /* Names are unique, so is the atom of each */
+            g_hash_table_insert(x11->clipboard_target_index,
+                GUINT_TO_POINTER(x11->clipboard_formats[i].atoms[j]),
+                GUINT_TO_POINTER(i * CLIPBOARD_FORMAT_MAX_ATOMS + j + 1));
         }
         x11->clipboard_formats[i].atom_count = j;
     }
+    x11->atom_names = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+    vdagent_x11_seed_atom_names(x11);
 
     /* We should not store properties (for selections) on the root window */
     x11->selection_window = XCreateSimpleWindow(x11->display, x11->root_window[0],
@@ -305,11 +452,17 @@ void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected)
 
     for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; ++sel) {
         vdagent_x11_set_clipboard_owner(x11, sel, owner_none);
+        free(x11->conversion[sel].data);
     }
 
+    vdagent_x11_randr_destroy(x11);
+    vdagent_x11_unregister_display(x11);
     XCloseDisplay(x11->display);
+    g_hash_table_destroy(x11->clipboard_target_index);
+    g_hash_table_destroy(x11->atom_names);
     g_free(x11->net_wm_name);
     free(x11->randr.failed_conf);
+    free(x11->guest_xorg_res);
     free(x11);
 }
 
@@ -318,32 +471,171 @@ int vdagent_x11_get_fd(struct vdagent_x11 *x11)
     return x11->fd;
 }
 
-static void vdagent_x11_next_selection_request(struct vdagent_x11 *x11)
+static void vdagent_x11_incr_data_unref(struct vdagent_x11_incr_data *data)
 {
-    struct vdagent_x11_selection_request *selection_request;
-    selection_request = x11->selection_req;
-    x11->selection_req = selection_request->next;
+    if (data && --data->refs == 0)
+        free(data);
+}
+
+static void vdagent_x11_remove_selection_request(struct vdagent_x11 *x11,
+    struct vdagent_x11_selection_request *selection_request)
+{
+    struct vdagent_x11_selection_request **reqp;
+
+    for (reqp = &x11->selection_req; *reqp; reqp = &(*reqp)->next) {
+        if (*reqp == selection_request) {
+            *reqp = selection_request->next;
+            break;
+        }
+    }
+
+    free(selection_request->multiple_pairs);
+    free(selection_request->multiple_done);
+    vdagent_x11_incr_data_unref(selection_request->data);
     free(selection_request);
 }
 
-static void vdagent_x11_next_conversion_request(struct vdagent_x11 *x11)
+/* Answer a selection request and forget about it */
+static void vdagent_x11_finish_selection_request(struct vdagent_x11 *x11,
+    struct vdagent_x11_selection_request *selection_request, Atom prop)
+{
+    vdagent_x11_send_selection_notify(x11, prop, selection_request);
+    vdagent_x11_remove_selection_request(x11, selection_request);
+}
+
+/* Return the oldest request waiting for client data of the given type, or
+   waiting for any type if type is VD_AGENT_CLIPBOARD_NONE */
+static struct vdagent_x11_selection_request *
+vdagent_x11_find_waiting_selection_request(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type)
+{
+    struct vdagent_x11_selection_request *req;
+
+    for (req = x11->selection_req; req; req = req->next) {
+        if (req->selection == selection &&
+                req->type != VD_AGENT_CLIPBOARD_NONE &&
+                (type == VD_AGENT_CLIPBOARD_NONE || req->type == type))
+            return req;
+    }
+    return NULL;
+}
+
+/* Make req wait for client data of the given type, only asking the client
+   for it if no other request is already waiting for the same data */
+static void vdagent_x11_request_client_data(struct vdagent_x11 *x11,
+    struct vdagent_x11_selection_request *req, uint32_t type)
+{
+    if (!vdagent_x11_find_waiting_selection_request(x11, req->selection,
+                                                    type))
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_REQUEST,
+                    req->selection, type, NULL, 0);
+    req->type = type;
+}
+
+static void vdagent_x11_next_conversion_request(struct vdagent_x11 *x11,
+    uint8_t selection)
 {
     struct vdagent_x11_conversion_request *conversion_req;
-    conversion_req = x11->conversion_req;
-    x11->conversion_req = conversion_req->next;
+    conversion_req = x11->conversion[selection].req;
+    x11->conversion[selection].req = conversion_req->next;
     free(conversion_req);
 }
 
-static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
-    uint8_t selection, int new_owner)
+static struct vdagent_x11_clipboard_cache *vdagent_x11_get_clipboard_cache(
+    struct vdagent_x11 *x11, uint8_t selection, uint32_t type)
+{
+    int i;
+
+    for (i = 0; i < clipboard_format_count; i++)
+        if (x11->clipboard_formats[i].type == type)
+            return &x11->clipboard_cache[selection][i];
+
+    return NULL;
+}
+
+static void vdagent_x11_clear_clipboard_cache(struct vdagent_x11 *x11,
+    uint8_t selection)
+{
+    int i;
+
+    for (i = 0; i < clipboard_format_count; i++) {
+        free(x11->clipboard_cache[selection][i].data);
+        x11->clipboard_cache[selection][i].data = NULL;
+        x11->clipboard_cache[selection][i].size = 0;
+    }
+}
+
+/* A fast non cryptographic 64 bit hash, consuming 8 bytes per round */
+static uint64_t vdagent_x11_hash_data(const uint8_t *data, uint32_t size)
+{
+    const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+    const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+    uint64_t hash = size * prime1, word;
+    uint32_t i;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&word, data + i, 8);
+        hash ^= word * prime2;
+        hash = ((hash << 31) | (hash >> 33)) * prime1;
+    }
+    word = 0;
+    memcpy(&word, data + i, size - i);
+    hash ^= word * prime2;
+    hash = ((hash << 31) | (hash >> 33)) * prime1;
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+static void vdagent_x11_record_sent_data(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, const uint8_t *data, uint32_t size)
+{
+    x11->clipboard_sent[selection].data_type = type;
+    x11->clipboard_sent[selection].data_size = size;
+    x11->clipboard_sent[selection].data_hash = vdagent_x11_hash_data(data, size);
+}
+
+static void vdagent_x11_send_clipboard_grab(struct vdagent_x11 *x11,
+    uint8_t selection)
+{
+    struct vdagent_x11_clipboard_sent *sent = &x11->clipboard_sent[selection];
+    uint32_t *types = x11->clipboard_agent_types[selection];
+    int type_count = x11->clipboard_type_count[selection];
+
+    if (x11->vdagentd)
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_GRAB, selection, 0,
+                    (uint8_t *)types, type_count * sizeof(uint32_t));
+
+    /* There is at most one type per format, so this always fits */
+    sent->type_count = MIN(type_count, (int)clipboard_format_count);
+    memcpy(sent->types, types, sent->type_count * sizeof(uint32_t));
+    sent->data_type = VD_AGENT_CLIPBOARD_NONE;
+    x11->clipboard_regrab_pending[selection] = 0;
+}
+
+static void vdagent_x11_send_clipboard_release(struct vdagent_x11 *x11,
+    uint8_t selection)
+{
+    if (x11->vdagentd)
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_RELEASE, selection,
+                    0, NULL, 0);
+
+    x11->clipboard_sent[selection].type_count = 0;
+    x11->clipboard_sent[selection].data_type = VD_AGENT_CLIPBOARD_NONE;
+    x11->clipboard_regrab_pending[selection] = 0;
+}
+
+static void vdagent_x11_clear_pending_requests(struct vdagent_x11 *x11,
+    uint8_t selection)
 {
-    struct vdagent_x11_selection_request *prev_sel, *curr_sel, *next_sel;
-    struct vdagent_x11_conversion_request *prev_conv, *curr_conv, *next_conv;
+    struct vdagent_x11_selection_request *curr_sel, *next_sel;
+    struct vdagent_x11_conversion_state *conv = &x11->conversion[selection];
     int once;
 
     /* Clear pending requests and clipboard data */
     once = 1;
-    prev_sel = NULL;
     next_sel = x11->selection_req;
     while (next_sel) {
         curr_sel = next_sel;
@@ -354,59 +646,48 @@ static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
                           "change, clearing");
                 once = 0;
             }
-            vdagent_x11_send_selection_notify(x11, None, curr_sel);
-            if (curr_sel == x11->selection_req) {
-                x11->selection_req = next_sel;
-                free(x11->selection_req_data);
-                x11->selection_req_data = NULL;
-                x11->selection_req_data_pos = 0;
-                x11->selection_req_data_size = 0;
-                x11->selection_req_atom = None;
-            } else {
-                prev_sel->next = next_sel;
-            }
-            free(curr_sel);
-        } else {
-            prev_sel = curr_sel;
+            vdagent_x11_finish_selection_request(x11, curr_sel, None);
         }
     }
 
-    once = 1;
-    prev_conv = NULL;
-    next_conv = x11->conversion_req;
-    while (next_conv) {
-        curr_conv = next_conv;
-        next_conv = curr_conv->next;
-        if (curr_conv->selection == selection) {
-            if (once) {
-                SELPRINTF("client clipboard request pending on clipboard "
-                          "ownership change, clearing");
-                once = 0;
-            }
-            if (x11->vdagentd)
-                udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
-                            VD_AGENT_CLIPBOARD_NONE, NULL, 0);
-            if (curr_conv == x11->conversion_req) {
-                x11->conversion_req = next_conv;
-                x11->clipboard_data_size = 0;
-                x11->expect_property_notify = 0;
-            } else {
-                prev_conv->next = next_conv;
-            }
-            free(curr_conv);
-        } else {
-            prev_conv = curr_conv;
-        }
+    if (conv->req) {
+        SELPRINTF("client clipboard request pending on clipboard "
+                  "ownership change, clearing");
+        /* The owner may still answer the conversion in progress */
+        conv->stale_notify = 1;
+        conv->stale_timestamp = conv->req->timestamp;
+    }
+    while (conv->req) {
+        if (conv->req->purpose == conversion_client && x11->vdagentd)
+            udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
+                        VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+        vdagent_x11_next_conversion_request(x11, selection);
     }
+    conv->data_size = 0;
+    conv->expect_property_notify = 0;
+    conv->incr_discard = 0;
+
+    vdagent_x11_clear_clipboard_cache(x11, selection);
+}
+
+static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
+    uint8_t selection, int new_owner)
+{
+    vdagent_x11_clear_pending_requests(x11, selection);
 
     if (new_owner == owner_none) {
         /* When going from owner_guest to owner_none we need to send a
-           clipboard release message to the client */
-        if (x11->clipboard_owner[selection] == owner_guest && x11->vdagentd) {
-            udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_RELEASE, selection,
-                        0, NULL, 0);
-        }
+           clipboard release message to the client, this includes the case
+           where the client still holds a grab from a previous guest owner */
+        if (x11->clipboard_owner[selection] == owner_guest ||
+                x11->clipboard_regrab_pending[selection])
+            vdagent_x11_send_clipboard_release(x11, selection);
         x11->clipboard_type_count[selection] = 0;
+    } else if (new_owner == owner_client) {
+        /* The client's own grab replaces any grab of ours */
+        x11->clipboard_sent[selection].type_count = 0;
+        x11->clipboard_sent[selection].data_type = VD_AGENT_CLIPBOARD_NONE;
+        x11->clipboard_regrab_pending[selection] = 0;
     }
     x11->clipboard_owner[selection] = new_owner;
 }
@@ -484,21 +765,37 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
             return;
         }
         VSELPRINTF("New selection owner: %u", (unsigned int)ev.xfev.owner);
+        x11->selection_owner[selection] = ev.xfev.owner;
+        x11->selection_timestamp[selection] = ev.xfev.selection_timestamp;
 
         /* Ignore becoming the owner ourselves */
         if (ev.xfev.owner == x11->selection_window)
             return;
 
-        /* If the clipboard owner is changed we no longer own it */
-        vdagent_x11_set_clipboard_owner(x11, selection, owner_none);
+        /* If the clipboard owner is changed we no longer own it. But when
+           another guest app takes over from a guest owner whose data the
+           client has already received, hold off on releasing the client's
+           grab, the new owner may well offer the very same data. See
+           vdagent_x11_handle_targets_notify(). */
+        if (ev.xfev.owner != None &&
+                (x11->clipboard_owner[selection] == owner_guest ||
+                 x11->clipboard_regrab_pending[selection]) &&
+                x11->clipboard_sent[selection].data_type !=
+                    VD_AGENT_CLIPBOARD_NONE) {
+            vdagent_x11_clear_pending_requests(x11, selection);
+            x11->clipboard_owner[selection] = owner_none;
+            x11->clipboard_type_count[selection] = 0;
+            x11->clipboard_regrab_pending[selection] = 1;
+        } else
+            vdagent_x11_set_clipboard_owner(x11, selection, owner_none);
 
         if (ev.xfev.owner == None)
             return;
 
         /* Request the supported targets from the new owner */
         XConvertSelection(x11->display, ev.xfev.selection, x11->targets_atom,
-                          x11->targets_atom, x11->selection_window,
-                          CurrentTime);
+                          x11->conversion[selection].targets_prop,
+                          x11->selection_window, CurrentTime);
         x11->expected_targets_notifies[selection]++;
         return;
     }
@@ -531,11 +828,10 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
         handled = 1;
         break;
     case PropertyNotify:
-        if (x11->expect_property_notify &&
-                                event.xproperty.state == PropertyNewValue) {
+        if (event.xproperty.state == PropertyNewValue) {
             vdagent_x11_handle_selection_notify(x11, &event, 1);
         }
-        if (x11->selection_req_data &&
+        if (x11->selection_req &&
                                  event.xproperty.state == PropertyDelete) {
             vdagent_x11_handle_property_delete_notify(x11, &event);
         }
@@ -549,36 +845,40 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
         handled = 1;
         break;
     case SelectionRequest: {
-        struct vdagent_x11_selection_request *req, *new_req;
+        struct vdagent_x11_selection_request *new_req;
+        struct vdagent_x11_selection_request **reqp;
+        int pending = 0;
 
         if (vdagent_x11_get_clipboard_selection(x11, &event, &selection)) {
             return;
         }
 
-        new_req = malloc(sizeof(*new_req));
+        handled = 1;
+
+        for (reqp = &x11->selection_req; *reqp; reqp = &(*reqp)->next)
+            pending++;
+        if (pending >= MAX_PENDING_SELECTION_REQUESTS) {
+            struct vdagent_x11_selection_request refused = { .event = event };
+
+            SELPRINTF("too many pending selection requests, refusing "
+                      "request for target %s",
+                vdagent_x11_get_atom_name(x11, event.xselectionrequest.target));
+            vdagent_x11_send_selection_notify(x11, None, &refused);
+            break;
+        }
+
+        new_req = calloc(1, sizeof(*new_req));
         if (!new_req) {
             SELPRINTF("out of memory on SelectionRequest, ignoring.");
             break;
         }
 
-        handled = 1;
-
         new_req->event = event;
         new_req->selection = selection;
-        new_req->next = NULL;
+        new_req->type = VD_AGENT_CLIPBOARD_NONE;
+        *reqp = new_req;
 
-        if (!x11->selection_req) {
-            x11->selection_req = new_req;
-            vdagent_x11_handle_selection_request(x11);
-            break;
-        }
-
-        /* maybe we should limit the selection_request stack depth ? */
-        req = x11->selection_req;
-        while (req->next)
-            req = req->next;
-
-        req->next = new_req;
+        vdagent_x11_handle_selection_request(x11, new_req);
         break;
     }
     }
@@ -595,14 +895,12 @@ void vdagent_x11_do_read(struct vdagent_x11 *x11)
         XNextEvent(x11->display, &event);
         vdagent_x11_handle_event(x11, event);
     }
-}
 
-static const char *vdagent_x11_get_atom_name(struct vdagent_x11 *x11, Atom a)
-{
-    if (a == None)
-        return "None";
-
-    return XGetAtomName(x11->display, a);
+    /* No names handed out by vdagent_x11_get_atom_name() are in use here */
+    if (g_hash_table_size(x11->atom_names) > ATOM_NAME_CACHE_SIZE) {
+        g_hash_table_remove_all(x11->atom_names);
+        vdagent_x11_seed_atom_names(x11);
+    }
 }
 
 static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
@@ -614,6 +912,7 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
     int format_ret, ret_val = -1;
     unsigned long len, remain;
     unsigned char *data = NULL;
+    struct vdagent_x11_conversion_state *conv = &x11->conversion[selection];
 
     *data_ret = NULL;
 
@@ -637,27 +936,35 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
         goto exit;
     }
 
-    if (!incr && prop != x11->targets_atom) {
+    if (!incr && prop != conv->targets_prop) {
         if (type_ret == x11->incr_atom) {
             int prop_min_size = *(uint32_t*)data;
 
-            if (x11->expect_property_notify) {
+            if (conv->expect_property_notify) {
                 SELPRINTF("received an incr SelectionNotify while "
                           "still reading another incr property");
                 goto exit;
             }
 
-            if (x11->clipboard_data_space < prop_min_size) {
-                free(x11->clipboard_data);
-                x11->clipboard_data = malloc(prop_min_size);
-                if (!x11->clipboard_data) {
+            /* Abandoning the transfer would leave the owner writing to our
+               property, corrupting the next conversion, so we go through
+               it without keeping the data */
+            if (conv->req && conv->req->purpose == conversion_prefetch &&
+                    (uint32_t)prop_min_size > x11->clipboard_prefetch_size) {
+                VSELPRINTF("not prefetching %d bytes of clipboard data",
+                           prop_min_size);
+                conv->incr_discard = 1;
+            } else if (conv->data_space < prop_min_size) {
+                free(conv->data);
+                conv->data = malloc(prop_min_size);
+                if (!conv->data) {
                     SELPRINTF("out of memory allocating clipboard buffer");
-                    x11->clipboard_data_space = 0;
+                    conv->data_space = 0;
                     goto exit;
                 }
-                x11->clipboard_data_space = prop_min_size;
+                conv->data_space = prop_min_size;
             }
-            x11->expect_property_notify = 1;
+            conv->expect_property_notify = 1;
             XSelectInput(x11->display, x11->selection_window,
                          PropertyChangeMask);
             XDeleteProperty(x11->display, x11->selection_window, prop);
@@ -691,29 +998,36 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
         break;
     }
 
+    if (incr && conv->incr_discard) {
+        if (len) {
+            XFree(data);
+            return 0; /* Wait for more data */
+        }
+        goto exit;
+    }
+
     if (incr) {
         if (len) {
-            if (x11->clipboard_data_size + len > x11->clipboard_data_space) {
-                void *old_clipboard_data = x11->clipboard_data;
+            if (conv->data_size + len > conv->data_space) {
+                void *old_clipboard_data = conv->data;
 
-                x11->clipboard_data_space = x11->clipboard_data_size + len;
-                x11->clipboard_data = realloc(x11->clipboard_data,
-                                              x11->clipboard_data_space);
-                if (!x11->clipboard_data) {
+                conv->data_space = conv->data_size + len;
+                conv->data = realloc(conv->data, conv->data_space);
+                if (!conv->data) {
                     SELPRINTF("out of memory allocating clipboard buffer");
-                    x11->clipboard_data_space = 0;
+                    conv->data_space = 0;
                     free(old_clipboard_data);
                     goto exit;
                 }
             }
-            memcpy(x11->clipboard_data + x11->clipboard_data_size, data, len);
-            x11->clipboard_data_size += len;
+            memcpy(conv->data + conv->data_size, data, len);
+            conv->data_size += len;
             VSELPRINTF("Appended %ld bytes to buffer", len);
             XFree(data);
             return 0; /* Wait for more data */
         }
-        len = x11->clipboard_data_size;
-        *data_ret = x11->clipboard_data;
+        len = conv->data_size;
+        *data_ret = conv->data;
     } else
         *data_ret = data;
 
@@ -729,39 +1043,56 @@ exit:
         XFree(data);
 
     if (incr) {
-        x11->clipboard_data_size = 0;
-        x11->expect_property_notify = 0;
+        conv->data_size = 0;
+        conv->expect_property_notify = 0;
+        conv->incr_discard = 0;
     }
 
     return ret_val;
 }
 
 static void vdagent_x11_get_selection_free(struct vdagent_x11 *x11,
-    unsigned char *data, int incr)
+    uint8_t selection, unsigned char *data, int incr)
 {
+    struct vdagent_x11_conversion_state *conv = &x11->conversion[selection];
+
     if (incr) {
         /* If the clipboard has grown large return the memory to the system */
-        if (x11->clipboard_data_space > 512 * 1024) {
-            free(x11->clipboard_data);
-            x11->clipboard_data = NULL;
-            x11->clipboard_data_space = 0;
+        if (conv->data_space > 512 * 1024) {
+            free(conv->data);
+            conv->data = NULL;
+            conv->data_space = 0;
         }
     } else if (data)
         XFree(data);
 }
 
+/* Find the format of target, and its rank in the atoms of the format,
+   lower is preferred.
+   Return value: the format index, or -1 if target is not a known format */
+static int vdagent_x11_lookup_target(struct vdagent_x11 *x11, Atom target,
+    int *rank)
+{
+    guint index;
+
+    index = GPOINTER_TO_UINT(g_hash_table_lookup(x11->clipboard_target_index,
+                                                 GUINT_TO_POINTER(target)));
+    if (!index)
+        return -1;
+
+    index--;
+    if (rank)
+        *rank = index % CLIPBOARD_FORMAT_MAX_ATOMS;
+    return index / CLIPBOARD_FORMAT_MAX_ATOMS;
+}
+
 static uint32_t vdagent_x11_target_to_type(struct vdagent_x11 *x11,
     uint8_t selection, Atom target)
 {
-    int i, j;
+    int format = vdagent_x11_lookup_target(x11, target, NULL);
 
-    for (i = 0; i < clipboard_format_count; i++) {
-        for (j = 0; j < x11->clipboard_formats[i].atom_count; j++) {
-            if (x11->clipboard_formats[i].atoms[j] == target) {
-                return x11->clipboard_formats[i].type;
-            }
-        }
-    }
+    if (format != -1)
+        return x11->clipboard_formats[format].type;
 
     VSELPRINTF("unexpected selection type %s",
                vdagent_x11_get_atom_name(x11, target));
@@ -782,65 +1113,280 @@ static Atom vdagent_x11_type_to_target(struct vdagent_x11 *x11,
     return None;
 }
 
-static void vdagent_x11_handle_conversion_request(struct vdagent_x11 *x11)
+#ifdef HAVE_LIBPNG
+/* If the types of a selection include from but not to, add to, which we
+   provide by converting the data of type from. Used to offer PNG to the
+   client when a guest app only offers BMP, which is many times larger, and
+   to offer BMP to guest apps when the client only offers PNG */
+static void vdagent_x11_add_converted_type(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t from, uint32_t to)
 {
+    uint32_t *types = x11->clipboard_agent_types[selection];
+    int *type_count = &x11->clipboard_type_count[selection];
+    int i, from_index = -1;
+
+    x11->clipboard_converted_type[selection] = VD_AGENT_CLIPBOARD_NONE;
+
+    for (i = 0; i < *type_count; i++) {
+        if (types[i] == to)
+            return;
+        if (types[i] == from)
+            from_index = i;
+    }
+    if (from_index == -1 ||
+            *type_count == sizeof(x11->clipboard_agent_types[0])/sizeof(uint32_t))
+        return;
+
+    types[*type_count] = to;
+    x11->clipboard_x11_targets[selection][*type_count] =
+        x11->clipboard_x11_targets[selection][from_index];
+    (*type_count)++;
+    x11->clipboard_converted_type[selection] = to;
+}
+#endif
+
+static void vdagent_x11_handle_conversion_request(struct vdagent_x11 *x11,
+    uint8_t selection)
+{
+    struct vdagent_x11_conversion_state *conv = &x11->conversion[selection];
+    struct vdagent_x11_clipboard_cache *cache;
     Atom clip = None;
 
-    if (!x11->conversion_req) {
+    /* Answer requests for data we still have from the same owner directly */
+    while (conv->req) {
+        cache = vdagent_x11_get_clipboard_cache(x11, selection,
+                                                conv->req->type);
+        if (conv->req->purpose != conversion_client ||
+                !cache || !cache->data ||
+                cache->owner != x11->selection_owner[selection] ||
+                cache->timestamp != x11->selection_timestamp[selection])
+            break;
+
+        VSELPRINTF("sending %u bytes of cached clipboard data", cache->size);
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
+                    conv->req->type, cache->data, cache->size);
+        vdagent_x11_record_sent_data(x11, selection, conv->req->type,
+                                     cache->data, cache->size);
+        vdagent_x11_next_conversion_request(x11, selection);
+    }
+
+    if (!conv->req) {
         return;
     }
 
-    vdagent_x11_get_clipboard_atom(x11, x11->conversion_req->selection, &clip);
-    XConvertSelection(x11->display, clip, x11->conversion_req->target,
-                      clip, x11->selection_window, CurrentTime);
+    /* Owners echo the time of the request in their SelectionNotify, which
+       allows recognizing answers to requests cancelled in the mean time */
+    conv->req->timestamp = x11->selection_timestamp[selection];
+    vdagent_x11_get_clipboard_atom(x11, selection, &clip);
+    XConvertSelection(x11->display, clip, conv->req->target,
+                      clip, x11->selection_window, conv->req->timestamp);
+}
+
+static void vdagent_x11_store_clipboard_cache(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, const uint8_t *data, uint32_t size)
+{
+    struct vdagent_x11_clipboard_cache *cache;
+
+    cache = vdagent_x11_get_clipboard_cache(x11, selection, type);
+    if (!cache || size > CLIPBOARD_CACHE_MAX_SIZE)
+        return;
+
+    free(cache->data);
+    cache->data = malloc(size);
+    if (!cache->data) {
+        cache->size = 0;
+        return;
+    }
+    memcpy(cache->data, data, size);
+    cache->size = size;
+    cache->owner = x11->selection_owner[selection];
+    cache->timestamp = x11->selection_timestamp[selection];
+}
+
+static void vdagent_x11_queue_conversion_request(struct vdagent_x11 *x11,
+    struct vdagent_x11_conversion_request *new_req)
+{
+    struct vdagent_x11_conversion_state *conv =
+        &x11->conversion[new_req->selection];
+    struct vdagent_x11_conversion_request *req;
+
+    new_req->next = NULL;
+
+    if (!conv->req) {
+        conv->req = new_req;
+        vdagent_x11_handle_conversion_request(x11, new_req->selection);
+        return;
+    }
+
+    /* maybe we should limit the conversion_request stack depth ? */
+    req = conv->req;
+    while (req->next)
+        req = req->next;
+
+    req->next = new_req;
+}
+
+/* Called when a guest app takes over a selection from another guest app
+   offering the same types as our current grab of the client's clipboard.
+   Instead of grabbing again, which makes the client fetch the data again,
+   convert the data the client got last time and compare it, see
+   vdagent_x11_finish_dedup_check().
+   Return value: 1 if the check was started, 0 if we should just grab */
+static int vdagent_x11_start_dedup_check(struct vdagent_x11 *x11,
+    uint8_t selection)
+{
+    struct vdagent_x11_clipboard_sent *sent = &x11->clipboard_sent[selection];
+    struct vdagent_x11_conversion_request *new_req;
+    Atom target;
+
+    if (sent->data_type == VD_AGENT_CLIPBOARD_NONE ||
+            sent->type_count != x11->clipboard_type_count[selection] ||
+            memcmp(sent->types, x11->clipboard_agent_types[selection],
+                   sent->type_count * sizeof(uint32_t)))
+        return 0;
+
+    target = vdagent_x11_type_to_target(x11, selection, sent->data_type);
+    if (target == None)
+        return 0;
+
+    new_req = malloc(sizeof(*new_req));
+    if (!new_req) {
+        SELPRINTF("out of memory on dedup check, grabbing");
+        return 0;
+    }
+
+    new_req->target = target;
+    new_req->type = sent->data_type;
+    new_req->selection = selection;
+    new_req->purpose = conversion_dedup;
+
+    /* The client keeps using its grab while we check, so any requests of
+       its end up behind ours and get answered by the new owner */
+    vdagent_x11_set_clipboard_owner(x11, selection, owner_guest);
+    vdagent_x11_queue_conversion_request(x11, new_req);
+    return 1;
+}
+
+static void vdagent_x11_finish_dedup_check(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, const uint8_t *data, int len)
+{
+    struct vdagent_x11_clipboard_sent *sent = &x11->clipboard_sent[selection];
+
+    /* The client may have disconnected or grabbed in the mean time */
+    if (x11->clipboard_owner[selection] != owner_guest)
+        return;
+
+    if (x11->clipboard_regrab_pending[selection] && len > 0 &&
+            type == sent->data_type && len == sent->data_size &&
+            vdagent_x11_hash_data(data, len) == sent->data_hash) {
+        x11->clipboard_dedup_hits++;
+        VSELPRINTF("new owner has identical data, keeping grab "
+                   "(dedup hits %u misses %u)", x11->clipboard_dedup_hits,
+                   x11->clipboard_dedup_misses);
+        x11->clipboard_regrab_pending[selection] = 0;
+        vdagent_x11_store_clipboard_cache(x11, selection, type, data, len);
+        return;
+    }
+
+    x11->clipboard_dedup_misses++;
+    VSELPRINTF("new owner has different data, grabbing "
+               "(dedup hits %u misses %u)", x11->clipboard_dedup_hits,
+               x11->clipboard_dedup_misses);
+    vdagent_x11_send_clipboard_grab(x11, selection);
+}
+
+/* Convert the text of a new guest owner right after grabbing the client's
+   clipboard for it, so that the request of the client for it, which
+   usually follows, is answered from the cache without waiting for the
+   owner. Only done when enabled, as it costs a conversion for each owner
+   change, including those of the PRIMARY selection. */
+static void vdagent_x11_start_prefetch(struct vdagent_x11 *x11,
+    uint8_t selection)
+{
+    struct vdagent_x11_conversion_request *new_req;
+    int i;
+
+    if (!x11->clipboard_prefetch_size)
+        return;
+
+    for (i = 0; i < x11->clipboard_type_count[selection]; i++)
+        if (x11->clipboard_agent_types[selection][i] ==
+                VD_AGENT_CLIPBOARD_UTF8_TEXT)
+            break;
+    if (i == x11->clipboard_type_count[selection])
+        return;
+
+    new_req = malloc(sizeof(*new_req));
+    if (!new_req) {
+        SELPRINTF("out of memory on clipboard prefetch, ignoring.");
+        return;
+    }
+
+    new_req->target = x11->clipboard_x11_targets[selection][i];
+    new_req->type = VD_AGENT_CLIPBOARD_UTF8_TEXT;
+    new_req->selection = selection;
+    new_req->purpose = conversion_prefetch;
+    vdagent_x11_queue_conversion_request(x11, new_req);
 }
 
 static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
                                                 XEvent *event, int incr)
 {
     int len = 0;
-    unsigned char *data = NULL;
+    unsigned char *data = NULL, *converted = NULL, *out;
+    struct vdagent_x11_conversion_state *conv;
+    struct vdagent_x11_conversion_request *conversion_req;
     uint32_t type;
     uint8_t selection = -1;
     Atom clip = None;
 
-    if (!x11->conversion_req) {
-        syslog(LOG_ERR, "SelectionNotify received without a target");
+    /* Each selection has its own property and queue of conversions */
+    if (incr) {
+        if (event->xproperty.window != x11->selection_window)
+            return;
+        if (event->xproperty.atom == x11->clipboard_atom)
+            selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+        else if (event->xproperty.atom == x11->clipboard_primary_atom)
+            selection = VD_AGENT_CLIPBOARD_SELECTION_PRIMARY;
+        else
+            return;
+        if (!x11->conversion[selection].expect_property_notify)
+            return;
+    } else if (vdagent_x11_get_clipboard_selection(x11, event, &selection)) {
         return;
     }
-    vdagent_x11_get_clipboard_atom(x11, x11->conversion_req->selection, &clip);
 
-    if (incr) {
-        if (event->xproperty.atom != clip ||
-                event->xproperty.window != x11->selection_window) {
-            return;
-        }
-    } else {
-        if (vdagent_x11_get_clipboard_selection(x11, event, &selection)) {
-            len = -1;
-        } else if (selection != x11->conversion_req->selection) {
-            SELPRINTF("Requested data for selection %d got %d",
-                      (int)x11->conversion_req->selection, (int)selection);
-            len = -1;
-        }
-        if (event->xselection.target != x11->conversion_req->target &&
-                event->xselection.target != x11->incr_atom) {
-            SELPRINTF("Requested %s target got %s",
-                vdagent_x11_get_atom_name(x11, x11->conversion_req->target),
-                vdagent_x11_get_atom_name(x11, event->xselection.target));
-            len = -1;
-        }
+    conv = &x11->conversion[selection];
+    conversion_req = conv->req;
+    if (!incr && conv->stale_notify &&
+            event->xselection.time == conv->stale_timestamp &&
+            (!conversion_req ||
+             conversion_req->timestamp != conv->stale_timestamp)) {
+        VSELPRINTF("ignoring SelectionNotify for a cancelled conversion");
+        conv->stale_notify = 0;
+        return;
+    }
+    if (!conversion_req) {
+        SELPRINTF("SelectionNotify received without a target");
+        return;
     }
+    vdagent_x11_get_clipboard_atom(x11, selection, &clip);
 
-    selection = x11->conversion_req->selection;
-    type = vdagent_x11_target_to_type(x11, selection,
-                                      x11->conversion_req->target);
+    if (!incr && event->xselection.target != conversion_req->target &&
+            event->xselection.target != x11->incr_atom) {
+        SELPRINTF("Requested %s target got %s",
+            vdagent_x11_get_atom_name(x11, conversion_req->target),
+            vdagent_x11_get_atom_name(x11, event->xselection.target));
+        len = -1;
+    }
+
+    type = vdagent_x11_target_to_type(x11, selection, conversion_req->target);
     if (type == VD_AGENT_CLIPBOARD_NONE)
         SELPRINTF("internal error conversion_req has bad target %s",
-                  vdagent_x11_get_atom_name(x11, x11->conversion_req->target));
+                  vdagent_x11_get_atom_name(x11, conversion_req->target));
     if (len == 0) { /* No errors so far */
         len = vdagent_x11_get_selection(x11, event, selection,
-                                        x11->conversion_req->target,
+                                        conversion_req->target,
                                         clip, 8, &data, incr);
         if (len == 0) { /* waiting for more data? */
             return;
@@ -850,31 +1396,61 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
         type = VD_AGENT_CLIPBOARD_NONE;
         len = 0;
     }
+    out = data;
+#ifdef HAVE_LIBPNG
+    if (type == VD_AGENT_CLIPBOARD_IMAGE_BMP &&
+            conversion_req->type == VD_AGENT_CLIPBOARD_IMAGE_PNG) {
+        uint32_t png_size;
+
+        converted = vdagent_image_bmp_to_png(data, len, &png_size);
+        if (converted) {
+            if (png_size < len)
+                x11->clipboard_png_bytes_saved += len - png_size;
+            VSELPRINTF("converted %d bytes BMP to %u bytes PNG, "
+                       "%"PRIu64" bytes saved so far", len, png_size,
+                       x11->clipboard_png_bytes_saved);
+            out = converted;
+            len = png_size;
+            type = VD_AGENT_CLIPBOARD_IMAGE_PNG;
+        } else {
+            type = VD_AGENT_CLIPBOARD_NONE;
+            len = 0;
+        }
+    }
+#endif
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
-                data, len);
-    vdagent_x11_get_selection_free(x11, data, incr);
-
-    vdagent_x11_next_conversion_request(x11);
-    vdagent_x11_handle_conversion_request(x11);
-}
-
-static Atom atom_lists_overlap(Atom *atoms1, Atom *atoms2, int l1, int l2)
-{
-    int i, j;
-
-    for (i = 0; i < l1; i++)
-        for (j = 0; j < l2; j++)
-            if (atoms1[i] == atoms2[j])
-                return atoms1[i];
+    if (conversion_req->purpose == conversion_dedup) {
+        vdagent_x11_finish_dedup_check(x11, selection, type, out, len);
+    } else if (conversion_req->purpose == conversion_prefetch) {
+        if (type != VD_AGENT_CLIPBOARD_NONE &&
+                (uint32_t)len <= x11->clipboard_prefetch_size) {
+            VSELPRINTF("prefetched %d bytes of clipboard data", len);
+            vdagent_x11_store_clipboard_cache(x11, selection, type, out, len);
+        }
+    } else {
+        if (type != VD_AGENT_CLIPBOARD_NONE) {
+            vdagent_x11_store_clipboard_cache(x11, selection, type, out, len);
+            vdagent_x11_record_sent_data(x11, selection, type, out, len);
+        }
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
+                    out, len);
+    }
+    free(converted);
+    vdagent_x11_get_selection_free(x11, selection, data, incr);
 
-    return 0;
+    vdagent_x11_next_conversion_request(x11, selection);
+    vdagent_x11_handle_conversion_request(x11, selection);
 }
 
 static void vdagent_x11_print_targets(struct vdagent_x11 *x11,
     uint8_t selection, const char *action, Atom *atoms, int c)
 {
     int i;
+
+    if (!x11->debug)
+        return;
+
+    vdagent_x11_cache_atom_names(x11, atoms, c);
     VSELPRINTF("%s %d targets:", action, c);
     for (i = 0; i < c; i++)
         VSELPRINTF("%s", vdagent_x11_get_atom_name(x11, atoms[i]));
@@ -883,8 +1459,10 @@ static void vdagent_x11_print_targets(struct vdagent_x11 *x11,
 static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
                                               XEvent *event)
 {
-    int i, len;
-    Atom atom, *atoms = NULL;
+    int i, len, format, rank;
+    Atom *atoms = NULL;
+    Atom best_atom[clipboard_format_count] = { None, };
+    int best_rank[clipboard_format_count] = { 0, };
     uint8_t selection;
     int *type_count;
 
@@ -907,53 +1485,66 @@ static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
     }
 
     len = vdagent_x11_get_selection(x11, event, selection,
-                                    XA_ATOM, x11->targets_atom, 32,
+                                    XA_ATOM,
+                                    x11->conversion[selection].targets_prop, 32,
                                     (unsigned char **)&atoms, 0);
-    if (len == 0 || len == -1) /* waiting for more data or error? */
+    if (len == 0 || len == -1) { /* waiting for more data or error? */
+        if (x11->clipboard_regrab_pending[selection])
+            vdagent_x11_send_clipboard_release(x11, selection);
         return;
+    }
 
     /* bytes -> atoms */
     len /= sizeof(Atom);
     vdagent_x11_print_targets(x11, selection, "received", atoms, len);
 
+    /* Pick the most preferred atom the owner offers of each format */
+    for (i = 0; i < len; i++) {
+        format = vdagent_x11_lookup_target(x11, atoms[i], &rank);
+        if (format == -1)
+            continue;
+        if (best_atom[format] == None || rank < best_rank[format]) {
+            best_atom[format] = atoms[i];
+            best_rank[format] = rank;
+        }
+    }
+
+    /* There is at most one type per format, so this always fits */
     type_count = &x11->clipboard_type_count[selection];
     *type_count = 0;
     for (i = 0; i < clipboard_format_count; i++) {
-        atom = atom_lists_overlap(x11->clipboard_formats[i].atoms, atoms,
-                                  x11->clipboard_formats[i].atom_count, len);
-        if (atom) {
-            x11->clipboard_agent_types[selection][*type_count] =
-                x11->clipboard_formats[i].type;
-            x11->clipboard_x11_targets[selection][*type_count] = atom;
-            (*type_count)++;
-            if (*type_count ==
-                    sizeof(x11->clipboard_agent_types[0])/sizeof(uint32_t)) {
-                SELPRINTF("handle_targets_notify: too many types");
-                break;
-            }
-        }
+        if (best_atom[i] == None)
+            continue;
+        x11->clipboard_agent_types[selection][*type_count] =
+            x11->clipboard_formats[i].type;
+        x11->clipboard_x11_targets[selection][*type_count] = best_atom[i];
+        (*type_count)++;
     }
 
+#ifdef HAVE_LIBPNG
+    vdagent_x11_add_converted_type(x11, selection,
+                                   VD_AGENT_CLIPBOARD_IMAGE_BMP,
+                                   VD_AGENT_CLIPBOARD_IMAGE_PNG);
+#endif
+
     if (*type_count) {
-        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_GRAB, selection, 0,
-                    (uint8_t *)x11->clipboard_agent_types[selection],
-                    *type_count * sizeof(uint32_t));
-        vdagent_x11_set_clipboard_owner(x11, selection, owner_guest);
+        if (!x11->clipboard_regrab_pending[selection] ||
+                !vdagent_x11_start_dedup_check(x11, selection)) {
+            vdagent_x11_send_clipboard_grab(x11, selection);
+            vdagent_x11_set_clipboard_owner(x11, selection, owner_guest);
+            vdagent_x11_start_prefetch(x11, selection);
+        }
+    } else if (x11->clipboard_regrab_pending[selection]) {
+        vdagent_x11_send_clipboard_release(x11, selection);
     }
 
-    vdagent_x11_get_selection_free(x11, (unsigned char *)atoms, 0);
+    vdagent_x11_get_selection_free(x11, selection, (unsigned char *)atoms, 0);
 }
 
 static void vdagent_x11_send_selection_notify(struct vdagent_x11 *x11,
     Atom prop, struct vdagent_x11_selection_request *request)
 {
-    XEvent res, *event;
-
-    if (request) {
-        event = &request->event;
-    } else {
-        event = &x11->selection_req->event;
-    }
+    XEvent res, *event = &request->event;
 
     res.xselection.property = prop;
     res.xselection.type = SelectionNotify;
@@ -966,170 +1557,454 @@ static void vdagent_x11_send_selection_notify(struct vdagent_x11 *x11,
     vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
     XSendEvent(x11->display, event->xselectionrequest.requestor, 0, 0, &res);
     vdagent_x11_restore_error_handler(x11);
+}
 
-    if (!request) {
-        vdagent_x11_next_selection_request(x11);
-        vdagent_x11_handle_selection_request(x11);
-    }
+/* Return value: 0 on success, non 0 if the requestor window is gone */
+static int vdagent_x11_set_targets_property(struct vdagent_x11 *x11,
+    uint8_t selection, Window requestor, Atom prop)
+{
+    Atom *targets = x11->clipboard_targets_reply[selection];
+    int target_count = x11->clipboard_targets_reply_count[selection];
+
+    vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+    XChangeProperty(x11->display, requestor, prop,
+                    XA_ATOM, 32, PropModeReplace, (unsigned char *)targets,
+                    target_count);
+    if (vdagent_x11_restore_error_handler(x11))
+        return -1;
+
+    vdagent_x11_print_targets(x11, selection, "sent", targets, target_count);
+    return 0;
 }
 
 static void vdagent_x11_send_targets(struct vdagent_x11 *x11,
-    uint8_t selection, XEvent *event)
+    struct vdagent_x11_selection_request *req)
 {
-    Atom prop, targets[256] = { x11->targets_atom, };
-    int i, j, k, target_count = 1;
+    XEvent *event = &req->event;
+    uint8_t selection = req->selection;
+    Atom prop;
 
-    for (i = 0; i < x11->clipboard_type_count[selection]; i++) {
-        for (j = 0; j < clipboard_format_count; j++) {
-            if (x11->clipboard_formats[j].type !=
-                    x11->clipboard_agent_types[selection][i])
-                continue;
+    prop = event->xselectionrequest.property;
+    if (prop == None)
+        prop = event->xselectionrequest.target;
 
-            for (k = 0; k < x11->clipboard_formats[j].atom_count; k++) {
-                targets[target_count] = x11->clipboard_formats[j].atoms[k];
-                target_count++;
-                if (target_count == sizeof(targets)/sizeof(Atom)) {
-                    SELPRINTF("send_targets: too many targets");
-                    goto exit_loop;
-                }
-            }
+    if (vdagent_x11_set_targets_property(x11, selection,
+            event->xselectionrequest.requestor, prop)) {
+        SELPRINTF("send_targets: Failed to sent, requestor window gone");
+        prop = None;
+    }
+    vdagent_x11_finish_selection_request(x11, req, prop);
+}
+
+/* Return the type of the client data to request for target, this differs
+   from the target's own type when we convert the client's data */
+static uint32_t vdagent_x11_target_to_client_type(struct vdagent_x11 *x11,
+    uint8_t selection, Atom target)
+{
+    uint32_t type = vdagent_x11_target_to_type(x11, selection, target);
+
+#ifdef HAVE_LIBPNG
+    /* We offer BMP by converting the client's PNG */
+    if (type == VD_AGENT_CLIPBOARD_IMAGE_BMP &&
+            x11->clipboard_converted_type[selection] == type)
+        type = VD_AGENT_CLIPBOARD_IMAGE_PNG;
+#endif
+    return type;
+}
+
+/* Request the data for the next type still needed by a MULTIPLE request
+   from the client, or complete the request if there is none left */
+static void vdagent_x11_continue_multiple_request(struct vdagent_x11 *x11,
+    struct vdagent_x11_selection_request *req)
+{
+    XEvent *event = &req->event;
+    uint8_t selection = req->selection;
+    Atom prop = event->xselectionrequest.property;
+    int i;
+
+    for (i = 0; i < req->multiple_count; i++) {
+        if (req->multiple_done[i])
+            continue;
+
+        vdagent_x11_request_client_data(x11, req,
+            vdagent_x11_target_to_client_type(x11, selection,
+                                              req->multiple_pairs[2 * i]));
+        return;
+    }
+
+    /* Write back the pairs, with the property of failed conversions
+       replaced by None as ICCCM prescribes */
+    vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+    XChangeProperty(x11->display, event->xselectionrequest.requestor,
+                    prop, x11->atom_pair_atom, 32, PropModeReplace,
+                    (unsigned char *)req->multiple_pairs,
+                    req->multiple_count * 2);
+    if (vdagent_x11_restore_error_handler(x11)) {
+        SELPRINTF("MULTIPLE: failed to send, requestor window gone");
+        prop = None;
+    }
+    vdagent_x11_finish_selection_request(x11, req, prop);
+}
+
+/* Handle a MULTIPLE request, which asks for several targets at once. We
+   answer TARGETS and TIMESTAMP right away and ask the client for the data
+   of each type only once, even if several targets map to it. */
+static void vdagent_x11_start_multiple_request(struct vdagent_x11 *x11,
+    struct vdagent_x11_selection_request *req)
+{
+    XEvent *event = &req->event;
+    Window requestor = event->xselectionrequest.requestor;
+    uint8_t selection = req->selection;
+    unsigned long nitems, remaining;
+    unsigned char *data = NULL;
+    Atom type_ret, target, *prop;
+    int i, format_ret;
+
+    if (event->xselectionrequest.property == None) {
+        SELPRINTF("MULTIPLE request without a property");
+        vdagent_x11_finish_selection_request(x11, req, None);
+        return;
+    }
+
+    vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+    if (XGetWindowProperty(x11->display, requestor,
+                           event->xselectionrequest.property, 0, LONG_MAX,
+                           False, AnyPropertyType, &type_ret, &format_ret,
+                           &nitems, &remaining, &data) != Success)
+        data = NULL;
+    if (vdagent_x11_restore_error_handler(x11) || !data ||
+            format_ret != 32 || nitems < 2 || nitems % 2) {
+        SELPRINTF("MULTIPLE request with an invalid atom pair list");
+        if (data)
+            XFree(data);
+        vdagent_x11_finish_selection_request(x11, req, None);
+        return;
+    }
+
+    /* Note Xlib returns format 32 data as an array of longs */
+    req->multiple_count = nitems / 2;
+    req->multiple_pairs = malloc(nitems * sizeof(Atom));
+    req->multiple_done = calloc(req->multiple_count, 1);
+    if (!req->multiple_pairs || !req->multiple_done) {
+        SELPRINTF("out of memory on MULTIPLE request");
+        XFree(data);
+        vdagent_x11_finish_selection_request(x11, req, None);
+        return;
+    }
+    memcpy(req->multiple_pairs, data, nitems * sizeof(Atom));
+    XFree(data);
+
+    for (i = 0; i < req->multiple_count; i++) {
+        target = req->multiple_pairs[2 * i];
+        prop = &req->multiple_pairs[2 * i + 1];
+
+        if (*prop == None) {
+            req->multiple_done[i] = 1;
+        } else if (target == x11->targets_atom) {
+            if (vdagent_x11_set_targets_property(x11, selection, requestor,
+                                                 *prop))
+                *prop = None;
+            req->multiple_done[i] = 1;
+        } else if (target == x11->timestamp_atom) {
+            long timestamp = event->xselectionrequest.time;
+
+            vdagent_x11_set_error_handler(x11,
+                                    vdagent_x11_ignore_bad_window_handler);
+            XChangeProperty(x11->display, requestor, *prop, target, 32,
+                            PropModeReplace, (guint8 *)&timestamp, 1);
+            if (vdagent_x11_restore_error_handler(x11))
+                *prop = None;
+            req->multiple_done[i] = 1;
+        } else if (target == x11->multiple_atom ||
+                   vdagent_x11_target_to_client_type(x11, selection, target)
+                       == VD_AGENT_CLIPBOARD_NONE) {
+            *prop = None;
+            req->multiple_done[i] = 1;
+        }
+    }
+
+    vdagent_x11_continue_multiple_request(x11, req);
+}
+
+/* Store data received from the client in the properties of all the targets
+   of a MULTIPLE request which need data of the type it is waiting for */
+static void vdagent_x11_multiple_request_data(struct vdagent_x11 *x11,
+    struct vdagent_x11_selection_request *req, uint32_t type,
+    uint8_t *data, uint32_t size)
+{
+    Window requestor = req->event.xselectionrequest.requestor;
+    uint32_t requested_type = req->type, out_size;
+    uint8_t *out, *converted = NULL, selection = req->selection;
+    Atom target, *prop;
+    int i;
+#ifdef HAVE_LIBPNG
+    uint32_t converted_size = 0;
+#endif
+
+    req->type = VD_AGENT_CLIPBOARD_NONE;
+
+    for (i = 0; i < req->multiple_count; i++) {
+        target = req->multiple_pairs[2 * i];
+        prop = &req->multiple_pairs[2 * i + 1];
+        if (req->multiple_done[i] ||
+                vdagent_x11_target_to_client_type(x11, selection,
+                                                  target) != requested_type)
+            continue;
+
+        req->multiple_done[i] = 1;
+        out = data;
+        out_size = size;
+#ifdef HAVE_LIBPNG
+        if (type == VD_AGENT_CLIPBOARD_IMAGE_PNG &&
+                vdagent_x11_target_to_type(x11, selection, target) ==
+                    VD_AGENT_CLIPBOARD_IMAGE_BMP) {
+            if (!converted)
+                converted = vdagent_image_png_to_bmp(data, size,
+                                                     &converted_size);
+            out = converted;
+            out_size = converted_size;
+        }
+#endif
+        if (type == VD_AGENT_CLIPBOARD_NONE || !out) {
+            *prop = None;
+            continue;
+        }
+        /* Sending data in parts with INCR inside a MULTIPLE is not
+           supported, such data must be requested by itself */
+        if (out_size > x11->max_prop_size) {
+            SELPRINTF("MULTIPLE: %u bytes of %s data is too large", out_size,
+                      vdagent_x11_get_atom_name(x11, target));
+            *prop = None;
+            continue;
+        }
+
+        vdagent_x11_set_error_handler(x11,
+                                      vdagent_x11_ignore_bad_window_handler);
+        XChangeProperty(x11->display, requestor, *prop, target, 8,
+                        PropModeReplace, out, out_size);
+        if (vdagent_x11_restore_error_handler(x11))
+            *prop = None;
+    }
+    free(converted);
+
+    vdagent_x11_continue_multiple_request(x11, req);
+}
+
+/* Answer a selection request with the client data it was waiting for, or
+   fail it if type is VD_AGENT_CLIPBOARD_NONE. Requests sending the data with
+   INCR share a copy of it, which is created on first use in *incr_data. */
+static void vdagent_x11_selection_request_data(struct vdagent_x11 *x11,
+    struct vdagent_x11_selection_request *req, uint32_t type,
+    uint8_t *data, uint32_t size, struct vdagent_x11_incr_data **incr_data)
+{
+    XEvent *event = &req->event;
+    uint8_t selection = req->selection;
+    uint32_t type_from_event;
+    uint8_t *converted = NULL;
+    Atom prop;
+
+    if (req->multiple_pairs) {
+        vdagent_x11_multiple_request_data(x11, req, type, data, size);
+        return;
+    }
+
+    req->type = VD_AGENT_CLIPBOARD_NONE;
+    if (type == VD_AGENT_CLIPBOARD_NONE) {
+        vdagent_x11_finish_selection_request(x11, req, None);
+        return;
+    }
+
+    type_from_event = vdagent_x11_target_to_type(x11, selection,
+                                             event->xselectionrequest.target);
+#ifdef HAVE_LIBPNG
+    if (type == VD_AGENT_CLIPBOARD_IMAGE_PNG &&
+            type_from_event == VD_AGENT_CLIPBOARD_IMAGE_BMP &&
+            x11->clipboard_converted_type[selection] == type_from_event) {
+        uint32_t bmp_size;
+
+        converted = vdagent_image_png_to_bmp(data, size, &bmp_size);
+        if (converted) {
+            VSELPRINTF("converted %u bytes PNG to %u bytes BMP",
+                       size, bmp_size);
+            data = converted;
+            size = bmp_size;
+            type = type_from_event;
         }
     }
-exit_loop:
+#endif
+    if (type_from_event != type) {
+        SELPRINTF("expecting type %u clipboard data got %u",
+                  type_from_event, type);
+        vdagent_x11_finish_selection_request(x11, req, None);
+        free(converted);
+        return;
+    }
 
     prop = event->xselectionrequest.property;
     if (prop == None)
         prop = event->xselectionrequest.target;
 
-    vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-    XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
-                    XA_ATOM, 32, PropModeReplace, (unsigned char *)&targets,
-                    target_count);
-    if (vdagent_x11_restore_error_handler(x11) == 0) {
-        vdagent_x11_print_targets(x11, selection, "sent",
-                                  targets, target_count);
-        vdagent_x11_send_selection_notify(x11, prop, NULL);
-    } else
-        SELPRINTF("send_targets: Failed to sent, requestor window gone");
+    if (size > x11->max_prop_size) {
+        unsigned long len = size;
+        VSELPRINTF("Starting incr send of clipboard data");
+
+        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+        XSelectInput(x11->display, event->xselectionrequest.requestor,
+                     PropertyChangeMask);
+        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
+                        x11->incr_atom, 32, PropModeReplace,
+                        (unsigned char*)&len, 1);
+        if (vdagent_x11_restore_error_handler(x11) == 0) {
+            /* Converted data is specific to this request, the client's
+               data is copied once for all the requests it answers */
+            if (converted || !*incr_data) {
+                req->data = malloc(sizeof(*req->data) + size);
+                if (req->data) {
+                    req->data->refs = 1;
+                    req->data->size = size;
+                    memcpy(req->data->data, data, size);
+                    if (!converted) {
+                        /* The caller holds a reference while answering */
+                        req->data->refs++;
+                        *incr_data = req->data;
+                    }
+                }
+            } else {
+                req->data = *incr_data;
+                req->data->refs++;
+            }
+            if (req->data != NULL) {
+                req->data_pos = 0;
+                req->data_atom = prop;
+                vdagent_x11_send_selection_notify(x11, prop, req);
+            } else {
+                SELPRINTF("out of memory allocating selection buffer");
+                vdagent_x11_finish_selection_request(x11, req, None);
+            }
+        } else {
+            SELPRINTF("clipboard data sent failed, requestor window gone");
+            vdagent_x11_remove_selection_request(x11, req);
+        }
+    } else {
+        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
+                        event->xselectionrequest.target, 8, PropModeReplace,
+                        data, size);
+        if (vdagent_x11_restore_error_handler(x11) == 0) {
+            vdagent_x11_finish_selection_request(x11, req, prop);
+        } else {
+            SELPRINTF("clipboard data sent failed, requestor window gone");
+            vdagent_x11_remove_selection_request(x11, req);
+        }
+    }
+    free(converted);
 }
 
-static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11)
+static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11,
+    struct vdagent_x11_selection_request *req)
 {
-    XEvent *event;
+    XEvent *event = &req->event;
     uint32_t type = VD_AGENT_CLIPBOARD_NONE;
-    uint8_t selection;
-
-    if (!x11->selection_req)
-        return;
-
-    event = &x11->selection_req->event;
-    selection = x11->selection_req->selection;
+    uint8_t selection = req->selection;
 
     if (x11->clipboard_owner[selection] != owner_client) {
         SELPRINTF("received selection request event for target %s, "
                   "while not owning client clipboard",
             vdagent_x11_get_atom_name(x11, event->xselectionrequest.target));
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+        vdagent_x11_finish_selection_request(x11, req, None);
         return;
     }
 
     if (event->xselectionrequest.target == x11->multiple_atom) {
-        SELPRINTF("multiple target not supported");
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+        vdagent_x11_start_multiple_request(x11, req);
         return;
     }
 
     if (event->xselectionrequest.target == x11->timestamp_atom) {
         /* TODO: use more accurate selection time */
-        guint32 timestamp = event->xselectionrequest.time;
+        long timestamp = event->xselectionrequest.time;
 
         XChangeProperty(x11->display, event->xselectionrequest.requestor,
                        event->xselectionrequest.property,
                         event->xselectionrequest.target, 32, PropModeReplace,
                         (guint8*)&timestamp, 1);
-        vdagent_x11_send_selection_notify(x11,
-                       event->xselectionrequest.property, NULL);
+        vdagent_x11_finish_selection_request(x11, req,
+                       event->xselectionrequest.property);
        return;
     }
 
-
     if (event->xselectionrequest.target == x11->targets_atom) {
-        vdagent_x11_send_targets(x11, selection, event);
+        vdagent_x11_send_targets(x11, req);
         return;
     }
 
-    type = vdagent_x11_target_to_type(x11, selection,
-                                      event->xselectionrequest.target);
+    type = vdagent_x11_target_to_client_type(x11, selection,
+                                             event->xselectionrequest.target);
     if (type == VD_AGENT_CLIPBOARD_NONE) {
         VSELPRINTF("guest app requested a non-advertised target");
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+        vdagent_x11_finish_selection_request(x11, req, None);
         return;
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_REQUEST, selection, type,
-                NULL, 0);
+    vdagent_x11_request_client_data(x11, req, type);
 }
 
 static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
                                                       XEvent *del_event)
 {
+    struct vdagent_x11_selection_request *req;
     XEvent *sel_event;
     int len;
     uint8_t selection;
 
-    assert(x11->selection_req);
-    sel_event = &x11->selection_req->event;
-    selection = x11->selection_req->selection;
-    if (del_event->xproperty.window != sel_event->xselectionrequest.requestor
-            || del_event->xproperty.atom != x11->selection_req_atom) {
-        return;
+    for (req = x11->selection_req; req; req = req->next) {
+        if (req->data &&
+                del_event->xproperty.window ==
+                    req->event.xselectionrequest.requestor &&
+                del_event->xproperty.atom == req->data_atom)
+            break;
     }
+    if (!req)
+        return;
 
-    len = x11->selection_req_data_size - x11->selection_req_data_pos;
+    sel_event = &req->event;
+    selection = req->selection;
+
+    len = req->data->size - req->data_pos;
     if (len > x11->max_prop_size) {
         len = x11->max_prop_size;
     }
 
     if (len) {
         VSELPRINTF("Sending %d-%d/%d bytes of clipboard data",
-                x11->selection_req_data_pos,
-                x11->selection_req_data_pos + len - 1,
-                x11->selection_req_data_size);
+                req->data_pos, req->data_pos + len - 1, req->data->size);
     } else {
         VSELPRINTF("Ending incr send of clipboard data");
     }
     vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
     XChangeProperty(x11->display, sel_event->xselectionrequest.requestor,
-                    x11->selection_req_atom,
+                    req->data_atom,
                     sel_event->xselectionrequest.target, 8, PropModeReplace,
-                    x11->selection_req_data + x11->selection_req_data_pos,
-                    len);
+                    req->data->data + req->data_pos, len);
     if (vdagent_x11_restore_error_handler(x11)) {
         SELPRINTF("incr sent failed, requestor window gone");
         len = 0;
     }
 
-    x11->selection_req_data_pos += len;
+    req->data_pos += len;
 
     /* Note we must explicitly send a 0 sized XChangeProperty to signal the
        incr transfer is done. Hence we do not check if we've send all data
        but instead check we've send the final 0 sized XChangeProperty. */
-    if (len == 0) {
-        free(x11->selection_req_data);
-        x11->selection_req_data = NULL;
-        x11->selection_req_data_pos = 0;
-        x11->selection_req_data_size = 0;
-        x11->selection_req_atom = None;
-        vdagent_x11_next_selection_request(x11);
-        vdagent_x11_handle_selection_request(x11);
-    }
+    if (len == 0)
+        vdagent_x11_remove_selection_request(x11, req);
 }
 
 void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
         uint8_t selection, uint32_t type)
 {
     Atom target, clip;
-    struct vdagent_x11_conversion_request *req, *new_req;
+    struct vdagent_x11_conversion_request *new_req;
 
     /* We don't use clip here, but we call get_clipboard_atom to verify
        selection is valid */
@@ -1154,23 +2029,12 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
     }
 
     new_req->target = target;
+    new_req->type = type;
     new_req->selection = selection;
-    new_req->next = NULL;
-
-    if (!x11->conversion_req) {
-        x11->conversion_req = new_req;
-        vdagent_x11_handle_conversion_request(x11);
-        /* Flush output buffers and consume any pending events */
-        vdagent_x11_do_read(x11);
-        return;
-    }
-
-    /* maybe we should limit the conversion_request stack depth ? */
-    req = x11->conversion_req;
-    while (req->next)
-        req = req->next;
-
-    req->next = new_req;
+    new_req->purpose = conversion_client;
+    vdagent_x11_queue_conversion_request(x11, new_req);
+    /* Flush output buffers and consume any pending events */
+    vdagent_x11_do_read(x11);
     return;
 
 none:
@@ -1178,6 +2042,31 @@ none:
                 selection, VD_AGENT_CLIPBOARD_NONE, NULL, 0);
 }
 
+/* Build our TARGETS reply for the types the client offers, done once per
+   grab rather than for each TARGETS request */
+static void vdagent_x11_build_targets_reply(struct vdagent_x11 *x11,
+    uint8_t selection)
+{
+    Atom *targets = x11->clipboard_targets_reply[selection];
+    int i, j, k, target_count = 1;
+    int added[clipboard_format_count] = { 0, };
+
+    targets[0] = x11->targets_atom;
+    for (i = 0; i < x11->clipboard_type_count[selection]; i++) {
+        for (j = 0; j < clipboard_format_count; j++) {
+            if (x11->clipboard_formats[j].type !=
+                    x11->clipboard_agent_types[selection][i] || added[j])
+                continue;
+
+            /* Each format is added at most once, so this always fits */
+            for (k = 0; k < x11->clipboard_formats[j].atom_count; k++)
+                targets[target_count++] = x11->clipboard_formats[j].atoms[k];
+            added[j] = 1;
+        }
+    }
+    x11->clipboard_targets_reply_count[selection] = target_count;
+}
+
 void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t *types, uint32_t type_count)
 {
@@ -1195,6 +2084,12 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
     memcpy(x11->clipboard_agent_types[selection], types,
            type_count * sizeof(uint32_t));
     x11->clipboard_type_count[selection] = type_count;
+#ifdef HAVE_LIBPNG
+    vdagent_x11_add_converted_type(x11, selection,
+                                   VD_AGENT_CLIPBOARD_IMAGE_PNG,
+                                   VD_AGENT_CLIPBOARD_IMAGE_BMP);
+#endif
+    vdagent_x11_build_targets_reply(x11, selection);
 
     XSetSelectionOwner(x11->display, clip,
                        x11->selection_window, CurrentTime);
@@ -1207,86 +2102,41 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
 void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t type, uint8_t *data, uint32_t size)
 {
-    Atom prop;
-    XEvent *event;
-    uint32_t type_from_event;
-
-    if (x11->selection_req_data) {
-        if (type || size) {
-            SELPRINTF("received clipboard data while still sending"
-                      " data from previous request, ignoring");
-        }
-        return;
-    }
-
-    if (!x11->selection_req) {
-        if (type || size) {
-            SELPRINTF("received clipboard data without an "
-                      "outstanding selection request, ignoring");
-        }
-        return;
-    }
-
-    event = &x11->selection_req->event;
-    type_from_event = vdagent_x11_target_to_type(x11,
-                                             x11->selection_req->selection,
-                                             event->xselectionrequest.target);
-    if (type_from_event != type ||
-            selection != x11->selection_req->selection) {
-        if (selection != x11->selection_req->selection) {
-            SELPRINTF("expecting data for selection %d got %d",
-                      (int)x11->selection_req->selection, (int)selection);
+    struct vdagent_x11_selection_request *req;
+    struct vdagent_x11_incr_data *incr_data = NULL;
+    uint32_t requested_type;
+
+    req = vdagent_x11_find_waiting_selection_request(x11, selection, type);
+    if (!req) {
+        /* The client's replies to our requests for different types may
+           arrive in any order, but a failed or mismatched reply can only be
+           matched to the oldest request still waiting */
+        req = vdagent_x11_find_waiting_selection_request(x11, selection,
+                                                     VD_AGENT_CLIPBOARD_NONE);
+        if (!req) {
+            if (type || size) {
+                SELPRINTF("received clipboard data without an "
+                          "outstanding selection request, ignoring");
+            }
+            return;
         }
-        if (type_from_event != type) {
+        if (type != VD_AGENT_CLIPBOARD_NONE) {
             SELPRINTF("expecting type %u clipboard data got %u",
-                      type_from_event, type);
+                      req->type, type);
         }
-        vdagent_x11_send_selection_notify(x11, None, NULL);
-
-        /* Flush output buffers and consume any pending events */
-        vdagent_x11_do_read(x11);
-        return;
+        type = VD_AGENT_CLIPBOARD_NONE;
+        size = 0;
     }
 
-    prop = event->xselectionrequest.property;
-    if (prop == None)
-        prop = event->xselectionrequest.target;
-
-    if (size > x11->max_prop_size) {
-        unsigned long len = size;
-        VSELPRINTF("Starting incr send of clipboard data");
-
-        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-        XSelectInput(x11->display, event->xselectionrequest.requestor,
-                     PropertyChangeMask);
-        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
-                        x11->incr_atom, 32, PropModeReplace,
-                        (unsigned char*)&len, 1);
-        if (vdagent_x11_restore_error_handler(x11) == 0) {
-            /* duplicate data */
-            x11->selection_req_data = malloc(size);
-            if (x11->selection_req_data != NULL) {
-                memcpy(x11->selection_req_data, data, size);
-                x11->selection_req_data_pos = 0;
-                x11->selection_req_data_size = size;
-                x11->selection_req_atom = prop;
-                vdagent_x11_send_selection_notify(x11, prop, x11->selection_req);
-            } else {
-                SELPRINTF("out of memory allocating selection buffer");
-            }
-        } else {
-            SELPRINTF("clipboard data sent failed, requestor window gone");
-        }
-    } else {
-        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
-                        event->xselectionrequest.target, 8, PropModeReplace,
-                        data, size);
-        if (vdagent_x11_restore_error_handler(x11) == 0)
-            vdagent_x11_send_selection_notify(x11, prop, NULL);
-        else
-            SELPRINTF("clipboard data sent failed, requestor window gone");
-    }
+    /* Answer all requests which are waiting for this data */
+    requested_type = req->type;
+    do {
+        vdagent_x11_selection_request_data(x11, req, type, data, size,
+                                           &incr_data);
+        req = vdagent_x11_find_waiting_selection_request(x11, selection,
+                                                         requested_type);
+    } while (req);
+    vdagent_x11_incr_data_unref(incr_data);
 
     /* Flush output buffers and consume any pending events */
     vdagent_x11_do_read(x11);
@@ -1329,6 +2179,9 @@ void vdagent_x11_client_disconnected(struct vdagent_x11 *x11)
     for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
         if (x11->clipboard_owner[sel] == owner_client)
             vdagent_x11_clipboard_release(x11, sel);
+        /* The next client has none of the data we sent */
+        x11->clipboard_sent[sel].data_type = VD_AGENT_CLIPBOARD_NONE;
+        x11->clipboard_regrab_pending[sel] = 0;
     }
 }
 
@@ -29,7 +29,7 @@
 struct vdagent_x11;
 
 struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
-    int debug, int sync);
+    int debug, int sync, uint32_t clipboard_prefetch_size);
 void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected);
 
 int  vdagent_x11_get_fd(struct vdagent_x11 *x11);
@@ -37,6 +37,11 @@ void vdagent_x11_do_read(struct vdagent_x11 *x11);
 
 void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
     VDAgentMonitorsConfig *mon_config, int fallback);
+/* Monitors configs may get applied in the background, this fd (-1 if not)
+   becomes readable when done, vdagent_x11_monitors_config_done() must then
+   be called */
+int  vdagent_x11_get_monitors_config_fd(struct vdagent_x11 *x11);
+void vdagent_x11_monitors_config_done(struct vdagent_x11 *x11);
 
 void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t *types, uint32_t type_count);
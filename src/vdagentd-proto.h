@@ -27,6 +27,10 @@
 
 #define DEFAULT_VIRTIO_PORT_PATH "/dev/virtio-ports/com.redhat.spice.0"
 
+/* Max amount of file xfer data the daemon passes on to the client for a
+   single xfer before it waits for a VDAGENTD_FILE_XFER_ACK */
+#define VDAGENTD_FILE_XFER_WINDOW (4 * 1024 * 1024)
+
 enum {
     VDAGENTD_GUEST_XORG_RESOLUTION, /* client -> daemon, arg1: overall width,
                                        arg2: overall height, data: array of
@@ -44,6 +48,14 @@ enum {
     VDAGENTD_FILE_XFER_DATA,
     VDAGENTD_FILE_XFER_DISABLE,
     VDAGENTD_CLIENT_DISCONNECTED,  /* daemon -> client */
+    VDAGENTD_FILE_XFER_DIRECT,  /* client -> daemon: arg1: id, data: uint64_t
+                                   file size, passes the write end of a
+                                   non-blocking pipe to write the data to,
+                                   which gets closed once it is all written.
+                                   daemon -> client: arg1: id, arg2: errno
+                                   value, passing the data on failed */
+    VDAGENTD_FILE_XFER_ACK,     /* client -> daemon, arg1: id, arg2: number
+                                   of data bytes written since the last ack */
     VDAGENTD_NO_MESSAGES /* Must always be last */
 };
 
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
 #include <spice/vd_agent.h>
@@ -43,8 +44,21 @@ struct vdagentd_uinput {
     int screen_count;
     VDAgentMouseState last;
     int fake;
+    /* With debug, how long mouse events take to resume after a resolution
+       change is logged, see vdagentd_uinput_do_mouse() */
+    struct timespec resized_at;
+    int log_resize_gap;
 };
 
+static long uinput_ms_since(const struct timespec *ts)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - ts->tv_sec) * 1000 +
+           (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
+
 struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     int width, int height,
     struct vdagentd_guest_xorg_resolution *screen_info, int screen_count,
@@ -80,22 +94,57 @@ void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp)
     *uinputp = NULL;
 }
 
+/* The device has a fixed range which vdagentd_uinput_do_mouse() scales the
+   coordinates to, so that it never needs to be recreated when the resolution
+   changes: that makes the X server re-probe a new device, and the mouse
+   events sent until it is done get lost */
+#define UINPUT_ABS_MAX 32767
+
+static int uinput_setup_device(struct vdagentd_uinput *uinput)
+{
+#ifdef UI_DEV_SETUP
+    struct uinput_setup setup = {
+        .name = "spice vdagent tablet",
+    };
+    struct uinput_abs_setup abs_setup = {
+        .absinfo.maximum = UINPUT_ABS_MAX,
+    };
+#endif
+    struct uinput_user_dev device = {
+        .name = "spice vdagent tablet",
+        .absmax  [ ABS_X ] = UINPUT_ABS_MAX,
+        .absmax  [ ABS_Y ] = UINPUT_ABS_MAX,
+    };
+    int rc;
+
+#ifdef UI_DEV_SETUP
+    /* Prefer the ioctls, older kernels only support writing the device */
+    abs_setup.code = ABS_X;
+    rc = ioctl(uinput->fd, UI_ABS_SETUP, &abs_setup);
+    if (rc == 0) {
+        abs_setup.code = ABS_Y;
+        rc = ioctl(uinput->fd, UI_ABS_SETUP, &abs_setup);
+    }
+    if (rc == 0)
+        rc = ioctl(uinput->fd, UI_DEV_SETUP, &setup);
+    if (rc == 0)
+        return 0;
+#endif
+
+    rc = write(uinput->fd, &device, sizeof(device));
+    if (rc != sizeof(device)) {
+        syslog(LOG_ERR, "write %s: %m", uinput->devname);
+        return -1;
+    }
+    return 0;
+}
+
 void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         int width, int height,
         struct vdagentd_guest_xorg_resolution *screen_info,
         int screen_count)
 {
     struct vdagentd_uinput *uinput = *uinputp;
-    struct uinput_user_dev device = {
-        .name = "spice vdagent tablet",
-#ifdef WITH_STATIC_UINPUT
-        .absmax  [ ABS_X ] = 32767,
-        .absmax  [ ABS_Y ] = 32767,
-#else
-        .absmax  [ ABS_X ] = width - 1,
-        .absmax  [ ABS_Y ] = height - 1,
-#endif
-    };
     int i, rc;
 
     if (uinput->debug) {
@@ -107,19 +156,15 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
 
     uinput->screen_info  = screen_info;
     uinput->screen_count = screen_count;
-
-    if (uinput->width == width && uinput->height == height)
-        return;
-
     uinput->width  = width;
     uinput->height = height;
+    if (uinput->debug) {
+        clock_gettime(CLOCK_MONOTONIC, &uinput->resized_at);
+        uinput->log_resize_gap = 1;
+    }
 
     if (uinput->fd != -1)
-#ifndef WITH_STATIC_UINPUT
-        close(uinput->fd);
-#else
         return;
-#endif
 
     uinput->fd = open(uinput->devname, uinput->fake ? O_WRONLY : O_RDWR);
     if (uinput->fd == -1) {
@@ -133,13 +178,6 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         return;
     }
 
-    rc = write(uinput->fd, &device, sizeof(device));
-    if (rc != sizeof(device)) {
-        syslog(LOG_ERR, "write %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-        return;
-    }
-
     /* buttons */
     ioctl(uinput->fd, UI_SET_EVBIT, EV_KEY);
     ioctl(uinput->fd, UI_SET_KEYBIT, BTN_LEFT);
@@ -155,11 +193,21 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     ioctl(uinput->fd, UI_SET_ABSBIT, ABS_X);
     ioctl(uinput->fd, UI_SET_ABSBIT, ABS_Y);
 
+    if (uinput_setup_device(uinput)) {
+        vdagentd_uinput_destroy(uinputp);
+        return;
+    }
+
     rc = ioctl(uinput->fd, UI_DEV_CREATE);
     if (rc < 0) {
         syslog(LOG_ERR, "create %s: %m", uinput->devname);
         vdagentd_uinput_destroy(uinputp);
+        return;
     }
+    /* The X server still has to probe the device before it gets events */
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "uinput: device created in %ld ms",
+               uinput_ms_since(&uinput->resized_at));
 }
 
 static void uinput_send_event(struct vdagentd_uinput **uinputp,
@@ -211,10 +259,11 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
                    mouse->x, mouse->y);
         mouse->x += uinput->screen_info[mouse->display_id].x;
         mouse->y += uinput->screen_info[mouse->display_id].y;
-#ifdef WITH_STATIC_UINPUT
-        mouse->x = mouse->x * 32767 / (uinput->width - 1);
-        mouse->y = mouse->y * 32767 / (uinput->height - 1);
-#endif
+        /* The fake device is read by the X server as is, in pixels */
+        if (!uinput->fake && uinput->width > 1 && uinput->height > 1) {
+            mouse->x = mouse->x * UINPUT_ABS_MAX / (uinput->width - 1);
+            mouse->y = mouse->y * UINPUT_ABS_MAX / (uinput->height - 1);
+        }
     }
 
     if (*uinputp && uinput->last.x != mouse->x) {
@@ -253,6 +302,11 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
             syslog(LOG_DEBUG, "mouse: syn");
         uinput_send_event(uinputp, EV_SYN, SYN_REPORT, 0);
     }
+    if (*uinputp && uinput->log_resize_gap) {
+        syslog(LOG_DEBUG, "uinput: first mouse event %ld ms after the "
+               "resolution change", uinput_ms_since(&uinput->resized_at));
+        uinput->log_resize_gap = 0;
+    }
 
     if (*uinputp)
         uinput->last = *mouse;
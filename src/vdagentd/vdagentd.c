@@ -63,6 +63,7 @@ static int only_once = 0;
 static struct udscs_server *server = NULL;
 static struct vdagent_virtio_port *virtio_port = NULL;
 static GHashTable *active_xfers = NULL;
+static GHashTable *direct_xfers = NULL;
 static struct session_info *session_info = NULL;
 static struct vdagentd_uinput *uinput = NULL;
 static VDAgentMonitorsConfig *mon_config = NULL;
@@ -77,6 +78,55 @@ static int retval = 0;
 static int client_connected = 0;
 static int max_clipboard = -1;
 
+/* File xfers the client sends data for, indexed by xfer id. To bound the
+   memory used when the agent is slower than the client, at most
+   VDAGENTD_FILE_XFER_WINDOW bytes of data may be in flight to the agent per
+   xfer. Reading from the virtio port is paused while any xfer is stalled. */
+struct active_xfer {
+    struct udscs_connection *conn;
+    uint64_t in_flight;
+    int passed_on_data; /* Some data went to the agent, see direct_xfer */
+};
+static int stalled_xfers = 0;
+
+/* File xfers for which the agent passed us a pipe to write the data to,
+   rather than sending it every chunk, indexed by xfer id. The agent splices
+   the data from the pipe to the file itself, so we never write to files as
+   root. The pipe is non-blocking, what it does not take right away is kept
+   in pending and the xfer counts as stalled until it is written out. */
+struct direct_xfer {
+    uint32_t id;
+    struct udscs_connection *conn;
+    int fd; /* -1 once done writing (or failed) */
+    uint64_t size;
+    uint64_t written; /* Including the pending data */
+    GByteArray *pending;
+    int stalled;
+};
+
+/* Resizing the client window makes the client send a monitors config for
+   about every pixel moved, applying each of these is expensive, so we only
+   apply the last one received once no new ones came in for the settle
+   time, or the oldest pending one is max latency old. */
+#define MONITORS_CONFIG_SETTLE_TIME  (150 * 1000) /* usec */
+#define MONITORS_CONFIG_MAX_LATENCY  (500 * 1000) /* usec */
+static int mon_config_pending = 0;
+static gint64 mon_config_first_received;
+static gint64 mon_config_last_received;
+static unsigned int mon_configs_dropped = 0;
+static int mon_config_superseded = 0; /* the pending config replaced others */
+
+/* The last monitors config we sent to the active agent. When resizing the
+   client window back and forth the config may settle back to it, then
+   there is no need to send it again, see apply_monitors_config(). This is
+   forgotten when the client or the agent changes. */
+static VDAgentMonitorsConfig *applied_mon_config = NULL;
+enum {
+    MONITORS_CONFIG_UNCHANGED,
+    MONITORS_CONFIG_POSITIONS_CHANGED, /* only the monitor positions changed */
+    MONITORS_CONFIG_CHANGED,
+};
+
 /* utility functions */
 static void virtio_msg_uint32_to_le(uint8_t *_msg, uint32_t size, uint32_t offset)
 {
@@ -138,8 +188,16 @@ static void send_capabilities(struct vdagent_virtio_port *vport,
     free(caps);
 }
 
+static void forget_applied_monitors_config(void)
+{
+    free(applied_mon_config);
+    applied_mon_config = NULL;
+}
+
 static void do_client_disconnect(void)
 {
+    g_hash_table_remove_all(direct_xfers);
+    forget_applied_monitors_config();
     if (client_connected) {
         udscs_server_write_all(server, VDAGENTD_CLIENT_DISCONNECTED, 0, 0,
                                NULL, 0);
@@ -170,6 +228,31 @@ void do_client_mouse(struct vdagentd_uinput **uinputp, VDAgentMouseState *mouse)
     }
 }
 
+static int monitors_config_changes(VDAgentMonitorsConfig *old_monitors,
+                                   VDAgentMonitorsConfig *new_monitors)
+{
+    VDAgentMonConfig *old_mon, *new_mon;
+    int i, positions_changed = 0;
+
+    if (!old_monitors ||
+            old_monitors->num_of_monitors != new_monitors->num_of_monitors ||
+            old_monitors->flags != new_monitors->flags)
+        return MONITORS_CONFIG_CHANGED;
+
+    for (i = 0; i < new_monitors->num_of_monitors; i++) {
+        old_mon = &old_monitors->monitors[i];
+        new_mon = &new_monitors->monitors[i];
+        if (old_mon->width != new_mon->width ||
+                old_mon->height != new_mon->height ||
+                old_mon->depth != new_mon->depth)
+            return MONITORS_CONFIG_CHANGED;
+        if (old_mon->x != new_mon->x || old_mon->y != new_mon->y)
+            positions_changed = 1;
+    }
+    return positions_changed ? MONITORS_CONFIG_POSITIONS_CHANGED :
+                               MONITORS_CONFIG_UNCHANGED;
+}
+
 static void do_client_monitors(struct vdagent_virtio_port *vport, int port_nr,
     VDAgentMessage *message_header, VDAgentMonitorsConfig *new_monitors)
 {
@@ -184,8 +267,6 @@ static void do_client_monitors(struct vdagent_virtio_port *vport, int port_nr,
         return;
     }
 
-    vdagentd_write_xorg_conf(new_monitors);
-
     if (!mon_config ||
             mon_config->num_of_monitors != new_monitors->num_of_monitors) {
         free(mon_config);
@@ -197,10 +278,16 @@ static void do_client_monitors(struct vdagent_virtio_port *vport, int port_nr,
     }
     memcpy(mon_config, new_monitors, size);
 
-    /* Send monitor config to currently active agent */
-    if (active_session_conn)
-        udscs_write(active_session_conn, VDAGENTD_MONITORS_CONFIG, 0, 0,
-                    (uint8_t *)mon_config, size);
+    /* Leave applying it to main_loop() once the config settles */
+    mon_config_last_received = g_get_monotonic_time();
+    if (mon_config_pending) {
+        mon_configs_dropped++;
+        mon_config_superseded = 1;
+    } else {
+        mon_config_first_received = mon_config_last_received;
+        mon_config_pending = 1;
+        mon_config_superseded = 0;
+    }
 
     /* Acknowledge reception of monitors config to spice server / client */
     reply.type  = GUINT32_TO_LE(VD_AGENT_MONITORS_CONFIG);
@@ -209,6 +296,61 @@ static void do_client_monitors(struct vdagent_virtio_port *vport, int port_nr,
                               (uint8_t *)&reply, sizeof(reply));
 }
 
+/* Return the time at which the pending monitors config should be applied */
+static gint64 monitors_config_deadline(void)
+{
+    return MIN(mon_config_last_received + MONITORS_CONFIG_SETTLE_TIME,
+               mon_config_first_received + MONITORS_CONFIG_MAX_LATENCY);
+}
+
+static void apply_monitors_config(void)
+{
+    uint32_t size;
+    int changes;
+
+    mon_config_pending = 0;
+    if (!mon_config)
+        return;
+
+    /* The client may have gone back to the config we applied last while
+       resizing. A config which did not replace others is always sent, the
+       client may be re-sending it because the guest changed since. */
+    changes = monitors_config_changes(applied_mon_config, mon_config);
+    if (changes == MONITORS_CONFIG_UNCHANGED && mon_config_superseded) {
+        if (debug)
+            syslog(LOG_DEBUG, "monitors config unchanged, not applying it");
+        return;
+    }
+
+    if (debug)
+        syslog(LOG_DEBUG, "applying monitors config (%s) after %d ms, "
+               "%u superseded configs dropped so far",
+               changes == MONITORS_CONFIG_UNCHANGED ? "unchanged" :
+               changes == MONITORS_CONFIG_POSITIONS_CHANGED ?
+               "positions only" : "modes",
+               (int)((g_get_monotonic_time() - mon_config_first_received) /
+                     1000), mon_configs_dropped);
+
+    /* With a single monitor the generated xorg.conf does not depend on
+       its position */
+    if (changes != MONITORS_CONFIG_POSITIONS_CHANGED ||
+            mon_config->num_of_monitors > 1)
+        vdagentd_write_xorg_conf(mon_config);
+
+    /* Send monitor config to currently active agent */
+    forget_applied_monitors_config();
+    if (!active_session_conn)
+        return;
+
+    size = sizeof(VDAgentMonitorsConfig) +
+           mon_config->num_of_monitors * sizeof(VDAgentMonConfig);
+    udscs_write(active_session_conn, VDAGENTD_MONITORS_CONFIG, 0, 0,
+                (uint8_t *)mon_config, size);
+    applied_mon_config = malloc(size);
+    if (applied_mon_config)
+        memcpy(applied_mon_config, mon_config, size);
+}
+
 static void do_client_volume_sync(struct vdagent_virtio_port *vport, int port_nr,
     VDAgentMessage *message_header,
     VDAgentAudioVolumeSync *avs)
@@ -317,12 +459,175 @@ static void send_file_xfer_status(struct vdagent_virtio_port *vport,
                                   (uint8_t *)&status, sizeof(status));
 }
 
+static void active_xfer_free(gpointer data)
+{
+    struct active_xfer *xfer = data;
+
+    if (xfer->in_flight >= VDAGENTD_FILE_XFER_WINDOW)
+        stalled_xfers--;
+    free(xfer);
+}
+
+static void direct_xfer_update_stalled(struct direct_xfer *xfer)
+{
+    int stalled = xfer->pending->len != 0;
+
+    if (stalled != xfer->stalled) {
+        if (debug)
+            syslog(LOG_DEBUG, "file-xfer %u: %s", xfer->id,
+                   stalled ? "pipe is full, pausing" : "resuming");
+        stalled_xfers += stalled ? 1 : -1;
+        xfer->stalled = stalled;
+    }
+}
+
+static void direct_xfer_free(gpointer data)
+{
+    struct direct_xfer *xfer = data;
+
+    if (xfer->fd != -1)
+        close(xfer->fd);
+    if (xfer->stalled)
+        stalled_xfers--;
+    g_byte_array_free(xfer->pending, TRUE);
+    free(xfer);
+}
+
+/* The agent runs as the user, only accept the write end of a pipe it made
+   non-blocking, as anything else could block us */
+static int direct_xfer_check_fd(int fd)
+{
+    struct stat st;
+    int flags;
+
+    if (fstat(fd, &st) || !S_ISFIFO(st.st_mode))
+        return 0;
+
+    flags = fcntl(fd, F_GETFL);
+    return flags != -1 && (flags & O_ACCMODE) == O_WRONLY &&
+           (flags & O_NONBLOCK);
+}
+
+/* Closes the pipe once all the data is written, so the agent gets EOF,
+   and tells the agent if passing the data on failed */
+static void direct_xfer_check_done(struct direct_xfer *xfer, int err)
+{
+    if (!err && (xfer->written < xfer->size || xfer->pending->len))
+        return;
+
+    close(xfer->fd);
+    xfer->fd = -1;
+    g_byte_array_set_size(xfer->pending, 0);
+    direct_xfer_update_stalled(xfer);
+    if (err)
+        udscs_write(xfer->conn, VDAGENTD_FILE_XFER_DIRECT, xfer->id, err,
+                    NULL, 0);
+}
+
+/* Writes out as much pending data as the pipe takes, and then as much of
+   data, keeping the rest for direct_xfers_handle_fds() */
+static int direct_xfer_write(struct direct_xfer *xfer,
+                             const uint8_t *data, size_t size)
+{
+    ssize_t n;
+
+    while (xfer->pending->len) {
+        n = write(xfer->fd, xfer->pending->data, xfer->pending->len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return errno;
+            break;
+        }
+        g_byte_array_remove_range(xfer->pending, 0, n);
+    }
+
+    while (size && !xfer->pending->len) {
+        n = write(xfer->fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return errno;
+            break;
+        }
+        data += n;
+        size -= n;
+    }
+    if (size)
+        g_byte_array_append(xfer->pending, data, size);
+
+    direct_xfer_update_stalled(xfer);
+    return 0;
+}
+
+static int direct_xfers_fill_fds(fd_set *writefds)
+{
+    GHashTableIter iter;
+    gpointer value;
+    int nfds = -1;
+
+    g_hash_table_iter_init(&iter, direct_xfers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct direct_xfer *xfer = value;
+
+        if (xfer->fd == -1 || !xfer->pending->len)
+            continue;
+        FD_SET(xfer->fd, writefds);
+        if (xfer->fd > nfds)
+            nfds = xfer->fd;
+    }
+
+    return nfds;
+}
+
+static void direct_xfers_handle_fds(fd_set *writefds)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, direct_xfers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct direct_xfer *xfer = value;
+
+        if (xfer->fd == -1 || !FD_ISSET(xfer->fd, writefds))
+            continue;
+        direct_xfer_check_done(xfer, direct_xfer_write(xfer, NULL, 0));
+    }
+}
+
+static void do_client_file_xfer_direct(struct direct_xfer *xfer,
+                                       VDAgentMessage *message_header,
+                                       VDAgentFileXferDataMessage *d)
+{
+    int err = 0;
+
+    if (xfer->fd == -1) /* Failed, waiting for the agent to report it */
+        return;
+
+    if (d->size > message_header->size - sizeof(*d)) {
+        syslog(LOG_ERR, "file-xfer %u: data message size mismatch", d->id);
+        err = EINVAL;
+    } else if (d->size > xfer->size - xfer->written) {
+        syslog(LOG_ERR, "file-xfer %u: received too much data", d->id);
+        err = EFBIG;
+    } else {
+        err = direct_xfer_write(xfer, d->data, d->size);
+        xfer->written += d->size;
+    }
+
+    direct_xfer_check_done(xfer, err);
+}
+
 static void do_client_file_xfer(struct vdagent_virtio_port *vport,
                                 VDAgentMessage *message_header,
                                 uint8_t *data)
 {
     uint32_t msg_type, id;
-    struct udscs_connection *conn;
+    uint64_t size;
+    struct active_xfer *active;
+    struct direct_xfer *xfer;
 
     switch (message_header->type) {
     case VD_AGENT_FILE_XFER_START: {
@@ -349,6 +654,8 @@ static void do_client_file_xfer(struct vdagent_virtio_port *vport,
         VDAgentFileXferStatusMessage *s = (VDAgentFileXferStatusMessage *)data;
         msg_type = VDAGENTD_FILE_XFER_STATUS;
         id = s->id;
+        /* The client won't send any more data for this xfer */
+        g_hash_table_remove(direct_xfers, GUINT_TO_POINTER(id));
         break;
     }
     case VD_AGENT_FILE_XFER_DATA: {
@@ -361,13 +668,36 @@ static void do_client_file_xfer(struct vdagent_virtio_port *vport,
         g_return_if_reached(); /* quiet uninitialized variable warning */
     }
 
-    conn = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(id));
-    if (!conn) {
+    active = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(id));
+    if (!active) {
         if (debug)
             syslog(LOG_DEBUG, "Could not find file-xfer %u (cancelled?)", id);
         return;
     }
-    udscs_write(conn, msg_type, 0, 0, data, message_header->size);
+
+    if (msg_type != VDAGENTD_FILE_XFER_DATA) {
+        udscs_write(active->conn, msg_type, 0, 0, data, message_header->size);
+        return;
+    }
+
+    xfer = g_hash_table_lookup(direct_xfers, GUINT_TO_POINTER(id));
+    if (xfer && xfer->conn == active->conn) {
+        do_client_file_xfer_direct(xfer, message_header,
+                                   (VDAgentFileXferDataMessage *)data);
+        return;
+    }
+
+    if (udscs_write(active->conn, msg_type, 0, 0, data, message_header->size))
+        return;
+    active->passed_on_data = 1;
+    size = ((VDAgentFileXferDataMessage *)data)->size;
+    if (active->in_flight < VDAGENTD_FILE_XFER_WINDOW &&
+            active->in_flight + size >= VDAGENTD_FILE_XFER_WINDOW) {
+        if (debug)
+            syslog(LOG_DEBUG, "file-xfer %u: out of credit, pausing", id);
+        stalled_xfers++;
+    }
+    active->in_flight += size;
 }
 
 static gsize vdagent_message_min_size[] =
@@ -785,6 +1115,7 @@ static void update_active_session_connection(struct udscs_connection *new_conn)
     active_session_conn = new_conn;
     if (debug)
         syslog(LOG_DEBUG, "%p is now the active session", new_conn);
+    forget_applied_monitors_config();
 
     if (active_session_conn &&
         session_info != NULL &&
@@ -808,7 +1139,10 @@ static void update_active_session_connection(struct udscs_connection *new_conn)
 
 static gboolean remove_active_xfers(gpointer key, gpointer value, gpointer conn)
 {
-    if (value == conn) {
+    struct active_xfer *xfer = value;
+
+    if (xfer->conn == conn) {
+        g_hash_table_remove(direct_xfers, key);
         send_file_xfer_status(virtio_port,
                               "Agent disc; cancelling file-xfer %u",
                               GPOINTER_TO_UINT(key),
@@ -838,6 +1172,10 @@ static void agent_connect(struct udscs_connection *conn)
     udscs_write(conn, VDAGENTD_VERSION, 0, 0,
                 (uint8_t *)VERSION, strlen(VERSION) + 1);
     update_active_session_connection(conn);
+
+    /* A (re)connecting agent typically means a new X server, which may see
+       different QXL devices or an xorg.conf changed behind our back */
+    vdagentd_xorg_conf_invalidate();
 }
 
 static void agent_disconnect(struct udscs_connection *conn)
@@ -880,11 +1218,25 @@ static void agent_read_complete(struct udscs_connection **connp,
             return;
         }
 
-        free(agent_data->screen_info);
-        res = malloc(n * sizeof(*res));
-        if (!res) {
-            syslog(LOG_ERR, "out of memory allocating screen info");
-            n = 0;
+        /* Nothing to update if the geometry did not change */
+        if (agent_data->screen_info && agent_data->screen_count == n &&
+                agent_data->width == header->arg1 &&
+                agent_data->height == header->arg2 &&
+                memcmp(agent_data->screen_info, data, n * sizeof(*res)) == 0) {
+            if (debug)
+                syslog(LOG_DEBUG, "guest xorg resolution unchanged");
+            break;
+        }
+
+        if (agent_data->screen_info && agent_data->screen_count == n) {
+            res = agent_data->screen_info;
+        } else {
+            free(agent_data->screen_info);
+            res = malloc(n * sizeof(*res));
+            if (!res) {
+                syslog(LOG_ERR, "out of memory allocating screen info");
+                n = 0;
+            }
         }
         memcpy(res, data, n * sizeof(*res));
         agent_data->width  = header->arg1;
@@ -911,11 +1263,73 @@ static void agent_read_complete(struct udscs_connection **connp,
         vdagent_virtio_port_write(virtio_port, VDP_CLIENT_PORT,
                                   VD_AGENT_FILE_XFER_STATUS, 0,
                                   (uint8_t *)&status, sizeof(status));
-        if (status.result == VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
+        if (status.result == VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA) {
+            struct active_xfer *xfer = calloc(1, sizeof(*xfer));
+            if (!xfer) {
+                syslog(LOG_ERR, "out of memory allocating file-xfer");
+                break;
+            }
+            xfer->conn = *connp;
             g_hash_table_insert(active_xfers, GUINT_TO_POINTER(status.id),
-                                *connp);
-        else
+                                xfer);
+        } else {
             g_hash_table_remove(active_xfers, GUINT_TO_POINTER(status.id));
+            g_hash_table_remove(direct_xfers, GUINT_TO_POINTER(status.id));
+        }
+        break;
+    }
+    case VDAGENTD_FILE_XFER_ACK: {
+        struct active_xfer *xfer = g_hash_table_lookup(active_xfers,
+                                                GUINT_TO_POINTER(header->arg1));
+        uint64_t acked;
+
+        if (!xfer || xfer->conn != *connp)
+            break;
+        /* Never trust the agent to ack more than it got */
+        acked = MIN(xfer->in_flight, header->arg2);
+        if (xfer->in_flight >= VDAGENTD_FILE_XFER_WINDOW &&
+                xfer->in_flight - acked < VDAGENTD_FILE_XFER_WINDOW) {
+            if (debug)
+                syslog(LOG_DEBUG, "file-xfer %u: got credit, resuming",
+                       header->arg1);
+            stalled_xfers--;
+        }
+        xfer->in_flight -= acked;
+        break;
+    }
+    case VDAGENTD_FILE_XFER_DIRECT: {
+        struct active_xfer *active = g_hash_table_lookup(active_xfers,
+                                                GUINT_TO_POINTER(header->arg1));
+        struct direct_xfer *xfer;
+        int fd = udscs_steal_message_fd(*connp);
+
+        /* Only the agent the client sends the data of the xfer for gets it.
+           Once some data went through udscs the rest has to as well, to
+           keep it in order. Otherwise the data simply gets passed on to the
+           agent. */
+        if (fd == -1 || header->size != sizeof(xfer->size) ||
+                *connp != active_session_conn || !active ||
+                active->conn != *connp || active->passed_on_data ||
+                !direct_xfer_check_fd(fd)) {
+            syslog(LOG_ERR, "invalid direct file-xfer message for xfer %u",
+                   header->arg1);
+            if (fd != -1)
+                close(fd);
+            break;
+        }
+        xfer = calloc(1, sizeof(*xfer));
+        if (!xfer) {
+            syslog(LOG_ERR, "out of memory allocating direct file-xfer");
+            close(fd);
+            break;
+        }
+        xfer->id = header->arg1;
+        xfer->conn = *connp;
+        xfer->fd = fd;
+        xfer->pending = g_byte_array_new();
+        memcpy(&xfer->size, data, sizeof(xfer->size));
+        g_hash_table_insert(direct_xfers, GUINT_TO_POINTER(header->arg1),
+                            xfer);
         break;
     }
 
@@ -979,6 +1393,8 @@ static void daemonize(void)
 static void main_loop(void)
 {
     fd_set readfds, writefds;
+    struct timeval tv, *timeout;
+    gint64 delay;
     int n, nfds;
     int ck_fd = 0;
     int once = 0;
@@ -988,6 +1404,10 @@ static void main_loop(void)
         FD_ZERO(&writefds);
 
         nfds = udscs_server_fill_fds(server, &readfds, &writefds);
+        n = direct_xfers_fill_fds(&writefds);
+        if (n >= nfds)
+            nfds = n + 1;
+        vdagent_virtio_port_pause_read(virtio_port, stalled_xfers > 0);
         n = vdagent_virtio_port_fill_fds(virtio_port, &readfds, &writefds);
         if (n >= nfds)
             nfds = n + 1;
@@ -999,7 +1419,15 @@ static void main_loop(void)
                 nfds = ck_fd + 1;
         }
 
-        n = select(nfds, &readfds, &writefds, NULL, NULL);
+        timeout = NULL;
+        if (mon_config_pending) {
+            delay = MAX(monitors_config_deadline() - g_get_monotonic_time(), 0);
+            tv.tv_sec = delay / G_USEC_PER_SEC;
+            tv.tv_usec = delay % G_USEC_PER_SEC;
+            timeout = &tv;
+        }
+
+        n = select(nfds, &readfds, &writefds, NULL, timeout);
         if (n == -1) {
             if (errno == EINTR)
                 continue;
@@ -1009,6 +1437,7 @@ static void main_loop(void)
         }
 
         udscs_server_handle_fds(server, &readfds, &writefds);
+        direct_xfers_handle_fds(&writefds);
 
         if (virtio_port) {
             once = 1;
@@ -1040,6 +1469,10 @@ static void main_loop(void)
             active_session = session_info_get_active_session(session_info);
             update_active_session_connection(NULL);
         }
+
+        if (mon_config_pending &&
+                g_get_monotonic_time() >= monitors_config_deadline())
+            apply_monitors_config();
     }
 }
 
@@ -1100,6 +1533,9 @@ int main(int argc, char *argv[])
     sigaction(SIGHUP, &act, NULL);
     sigaction(SIGTERM, &act, NULL);
     sigaction(SIGQUIT, &act, NULL);
+    /* Writing to a pipe the agent closed must not kill us, see direct_xfer */
+    act.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &act, NULL);
 
     openlog("spice-vdagentd", do_daemonize ? 0 : LOG_PERROR, LOG_USER);
 
@@ -1142,11 +1578,16 @@ int main(int argc, char *argv[])
     if (!session_info)
         syslog(LOG_WARNING, "no session info, max 1 session agent allowed");
 
-    active_xfers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    active_xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, active_xfer_free);
+    direct_xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, direct_xfer_free);
     main_loop();
 
     release_clipboards();
 
+    g_hash_table_destroy(direct_xfers);
+    g_hash_table_destroy(active_xfers);
     vdagentd_uinput_destroy(&uinput);
     vdagent_virtio_port_flush(&virtio_port);
     vdagent_virtio_port_destroy(&virtio_port);
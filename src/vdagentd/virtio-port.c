@@ -55,6 +55,7 @@ struct vdagent_virtio_port {
     int fd;
     int opening;
     int is_uds;
+    int read_paused;
 
     /* Chunk read stuff, single buffer, separate header and data buffer */
     int chunk_header_read;
@@ -157,13 +158,21 @@ int vdagent_virtio_port_fill_fds(struct vdagent_virtio_port *vport,
     if (!vport)
         return -1;
 
-    FD_SET(vport->fd, readfds);
+    if (!vport->read_paused)
+        FD_SET(vport->fd, readfds);
     if (vport->write_buf)
         FD_SET(vport->fd, writefds);
 
     return vport->fd + 1;
 }
 
+void vdagent_virtio_port_pause_read(struct vdagent_virtio_port *vport,
+        int paused)
+{
+    if (vport)
+        vport->read_paused = paused;
+}
+
 void vdagent_virtio_port_handle_fds(struct vdagent_virtio_port **vportp,
         fd_set *readfds, fd_set *writefds)
 {
@@ -67,6 +67,11 @@ void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp);
 int vdagent_virtio_port_fill_fds(struct vdagent_virtio_port *vport,
         fd_set *readfds, fd_set *writefds);
 
+/* Stop (paused != 0) or resume adding the port to readfds in
+   vdagent_virtio_port_fill_fds(), writes are not affected */
+void vdagent_virtio_port_pause_read(struct vdagent_virtio_port *vport,
+        int paused);
+
 /* Handle any events flagged by select for the given vdagent_virtio_port.
    Note the port may be destroyed (when disconnected) by this call
    in this case the disconnect calllback will get called before the
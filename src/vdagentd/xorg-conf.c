@@ -30,24 +30,37 @@
 #include <errno.h>
 #include <limits.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <glib.h>
 #include "xorg-conf.h"
 
-#define FPRINTF(...) \
-    do { \
-        r = fprintf(f, __VA_ARGS__); \
-        if (r < 0) { \
-            syslog(LOG_ERR, "Error writing to %s: %m", xorg_conf); \
-            fclose(f); \
-            pci_system_cleanup(); \
-            return; \
-        } \
-    } while(0)
+#ifdef HAVE_PCIACCESS
+#define XORG_CONF     "/var/run/spice-vdagentd/xorg.conf.spice"
+#define XORG_CONF_OLD "/var/run/spice-vdagentd/xorg.conf.spice.old"
 
-void vdagentd_write_xorg_conf(VDAgentMonitorsConfig *monitor_conf)
+struct qxl_device {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+};
+
+/* Enumerating the PCI devices is slow compared to how often monitor configs
+   can come in, so we only do it again when we found none, or fewer than
+   the client has monitors and it did not have that many before, which
+   is when a device may have been hotplugged, or when the cache is dropped
+   with vdagentd_xorg_conf_invalidate(). Other changes, ie a device being
+   removed, go unnoticed until then. */
+static struct qxl_device *qxl_devices = NULL;
+static int qxl_device_count = 0;
+static int qxl_devices_max_monitors = 0;
+
+/* What xorg.conf currently contains, NULL if unknown. Edits or removal of
+   the file by others go unnoticed until vdagentd_xorg_conf_invalidate(). */
+static gchar *xorg_conf_content = NULL;
+
+static void find_qxl_devices(void)
 {
-#ifdef HAVE_PCIACCESS
-    int i, r, count, min_x = INT_MAX, min_y = INT_MAX;
-    FILE *f;
+    int r;
     struct pci_device_iterator *it;
     struct pci_device *dev;
     const struct pci_id_match qxl_id_match = {
@@ -56,91 +69,91 @@ void vdagentd_write_xorg_conf(VDAgentMonitorsConfig *monitor_conf)
         .subvendor_id = PCI_MATCH_ANY,
         .subdevice_id = PCI_MATCH_ANY,
     };
-    const char *xorg_conf = "/var/run/spice-vdagentd/xorg.conf.spice";
-    const char *xorg_conf_old = "/var/run/spice-vdagentd/xorg.conf.spice.old";
-
-    r = rename(xorg_conf, xorg_conf_old);
-    if (r && errno != ENOENT) {
-        syslog(LOG_ERR,
-               "Error renaming %s to %s: %m, not generating xorg.conf",
-               xorg_conf, xorg_conf_old);
-        return;
-    }
+
+    g_free(qxl_devices);
+    qxl_devices = NULL;
+    qxl_device_count = 0;
 
     r = pci_system_init();
     if (r) {
-        syslog(LOG_ERR, "Error initializing libpciaccess: %d, not generating xorg.conf", r);
+        syslog(LOG_ERR, "Error initializing libpciaccess: %d", r);
         return;
     }
 
     it = pci_id_match_iterator_create(&qxl_id_match);
     if (!it) {
-        syslog(LOG_ERR, "Error could not create pci id iterator for QXL devices, not generating xorg.conf");
+        syslog(LOG_ERR, "Error could not create pci id iterator for QXL devices");
         pci_system_cleanup();
         return;
     }
 
-    dev = pci_device_next(it);
-    if (!dev) {
-        syslog(LOG_ERR, "No QXL devices found, not generating xorg.conf");
-        pci_system_cleanup();
-        return;
+    while ((dev = pci_device_next(it))) {
+        qxl_devices = g_renew(struct qxl_device, qxl_devices,
+                              qxl_device_count + 1);
+        qxl_devices[qxl_device_count].bus = dev->bus;
+        qxl_devices[qxl_device_count].dev = dev->dev;
+        qxl_devices[qxl_device_count].func = dev->func;
+        qxl_device_count++;
     }
 
-    f = fopen(xorg_conf, "w");
-    if (!f) {
-        syslog(LOG_ERR, "Error opening %s for writing: %m", xorg_conf);
-        pci_system_cleanup();
-        return;
-    }
+    pci_iterator_destroy(it);
+    pci_system_cleanup();
+}
+
+static gchar *render_xorg_conf(VDAgentMonitorsConfig *monitor_conf)
+{
+    int i, count, min_x = INT_MAX, min_y = INT_MAX;
+    GString *conf = g_string_new(NULL);
 
-    FPRINTF("# xorg.conf generated by spice-vdagentd\n");
-    FPRINTF("# generated from monitor info provided by the client\n\n");
+    g_string_append(conf, "# xorg.conf generated by spice-vdagentd\n");
+    g_string_append(conf, "# generated from monitor info provided by the client\n\n");
 
     if (monitor_conf->num_of_monitors == 1) {
-        FPRINTF("# Client has only 1 monitor\n");
-        FPRINTF("# This works best with no xorg.conf, leaving xorg.conf empty\n");
-        fclose(f);
-        pci_system_cleanup();
-        return;
+        g_string_append(conf, "# Client has only 1 monitor\n");
+        g_string_append(conf, "# This works best with no xorg.conf, leaving xorg.conf empty\n");
+        return g_string_free(conf, FALSE);
+    }
+
+    g_string_append(conf, "Section \"ServerFlags\"\n");
+    g_string_append(conf, "\tOption\t\t\"Xinerama\"\t\"true\"\n");
+    g_string_append(conf, "EndSection\n\n");
+
+    for (i = 0; i < qxl_device_count; i++) {
+        g_string_append(conf, "Section \"Device\"\n");
+        g_string_append_printf(conf, "\tIdentifier\t\"qxl%d\"\n", i);
+        g_string_append(conf, "\tDriver\t\t\"qxl\"\n");
+        g_string_append_printf(conf, "\tBusID\t\t\"PCI:%02d:%02d:%d\"\n",
+                               qxl_devices[i].bus, qxl_devices[i].dev,
+                               qxl_devices[i].func);
+        g_string_append(conf, "\tOption\t\t\"NumHeads\"\t\"1\"\n");
+        g_string_append(conf, "EndSection\n\n");
     }
 
-    FPRINTF("Section \"ServerFlags\"\n");
-    FPRINTF("\tOption\t\t\"Xinerama\"\t\"true\"\n");
-    FPRINTF("EndSection\n\n");
-
-    i = 0;
-    do {
-        FPRINTF("Section \"Device\"\n");
-        FPRINTF("\tIdentifier\t\"qxl%d\"\n", i++);
-        FPRINTF("\tDriver\t\t\"qxl\"\n");
-        FPRINTF("\tBusID\t\t\"PCI:%02d:%02d:%d\"\n",
-                dev->bus, dev->dev, dev->func);
-        FPRINTF("\tOption\t\t\"NumHeads\"\t\"1\"\n");
-        FPRINTF("EndSection\n\n");
-    } while ((dev = pci_device_next(it)));
-
-    if (i < monitor_conf->num_of_monitors) {
-        FPRINTF("# Client has %d monitors, but only %d qxl devices found\n",
-                monitor_conf->num_of_monitors, i);
-        FPRINTF("# Only generation %d \"Screen\" sections\n\n", i);
-        count = i;
+    if (qxl_device_count < monitor_conf->num_of_monitors) {
+        g_string_append_printf(conf,
+                "# Client has %d monitors, but only %d qxl devices found\n",
+                monitor_conf->num_of_monitors, qxl_device_count);
+        g_string_append_printf(conf,
+                "# Only generation %d \"Screen\" sections\n\n",
+                qxl_device_count);
+        count = qxl_device_count;
     } else {
         count = monitor_conf->num_of_monitors;
     }
 
     for (i = 0; i < count; i++) {
-        FPRINTF("Section \"Screen\"\n");
-        FPRINTF("\tIdentifier\t\"Screen%d\"\n", i);
-        FPRINTF("\tDevice\t\t\"qxl%d\"\n", i);
-        FPRINTF("\tDefaultDepth\t24\n");
-        FPRINTF("\tSubSection \"Display\"\n");
-        FPRINTF("\t\tViewport\t0 0\n");
-        FPRINTF("\t\tDepth\t\t24\n");
-        FPRINTF("\t\tModes\t\t\"%dx%d\"\n", monitor_conf->monitors[i].width,
-                monitor_conf->monitors[i].height);
-        FPRINTF("\tEndSubSection\n");
-        FPRINTF("EndSection\n\n");
+        g_string_append(conf, "Section \"Screen\"\n");
+        g_string_append_printf(conf, "\tIdentifier\t\"Screen%d\"\n", i);
+        g_string_append_printf(conf, "\tDevice\t\t\"qxl%d\"\n", i);
+        g_string_append(conf, "\tDefaultDepth\t24\n");
+        g_string_append(conf, "\tSubSection \"Display\"\n");
+        g_string_append(conf, "\t\tViewport\t0 0\n");
+        g_string_append(conf, "\t\tDepth\t\t24\n");
+        g_string_append_printf(conf, "\t\tModes\t\t\"%dx%d\"\n",
+                               monitor_conf->monitors[i].width,
+                               monitor_conf->monitors[i].height);
+        g_string_append(conf, "\tEndSubSection\n");
+        g_string_append(conf, "EndSection\n\n");
     }
 
     /* monitor_conf may contain negative values, convert these to 0 - # */
@@ -153,16 +166,94 @@ void vdagentd_write_xorg_conf(VDAgentMonitorsConfig *monitor_conf)
         }
     }
 
-    FPRINTF("Section \"ServerLayout\"\n");
-    FPRINTF("\tIdentifier\t\"layout\"\n");
+    g_string_append(conf, "Section \"ServerLayout\"\n");
+    g_string_append(conf, "\tIdentifier\t\"layout\"\n");
     for (i = 0; i < count; i++) {
-        FPRINTF("\tScreen\t\t\"Screen%d\" %d %d\n", i,
-                monitor_conf->monitors[i].x - min_x,
-                monitor_conf->monitors[i].y - min_y);
+        g_string_append_printf(conf, "\tScreen\t\t\"Screen%d\" %d %d\n", i,
+                               monitor_conf->monitors[i].x - min_x,
+                               monitor_conf->monitors[i].y - min_y);
     }
-    FPRINTF("EndSection\n");
+    g_string_append(conf, "EndSection\n");
 
-    fclose(f);
-    pci_system_cleanup();
+    return g_string_free(conf, FALSE);
+}
+
+/* Keep the previous xorg.conf around as xorg.conf.old, as a hardlink so
+   that xorg.conf itself can be replaced atomically */
+static int backup_xorg_conf(void)
+{
+    if (unlink(XORG_CONF_OLD) && errno != ENOENT) {
+        syslog(LOG_ERR, "Error removing %s: %m", XORG_CONF_OLD);
+        return -1;
+    }
+    if (link(XORG_CONF, XORG_CONF_OLD) && errno != ENOENT) {
+        syslog(LOG_ERR, "Error linking %s to %s: %m", XORG_CONF, XORG_CONF_OLD);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+void vdagentd_xorg_conf_invalidate(void)
+{
+#ifdef HAVE_PCIACCESS
+    g_free(qxl_devices);
+    qxl_devices = NULL;
+    qxl_device_count = 0;
+    qxl_devices_max_monitors = 0;
+    g_free(xorg_conf_content);
+    xorg_conf_content = NULL;
+#endif
+}
+
+void vdagentd_write_xorg_conf(VDAgentMonitorsConfig *monitor_conf)
+{
+#ifdef HAVE_PCIACCESS
+    GError *err = NULL;
+    gchar *conf;
+
+    if (qxl_device_count == 0 ||
+            (qxl_device_count < monitor_conf->num_of_monitors &&
+             monitor_conf->num_of_monitors > qxl_devices_max_monitors)) {
+        find_qxl_devices();
+        qxl_devices_max_monitors = monitor_conf->num_of_monitors;
+    }
+
+    if (qxl_device_count == 0) {
+        syslog(LOG_ERR, "No QXL devices found, not generating xorg.conf");
+        if (rename(XORG_CONF, XORG_CONF_OLD) && errno != ENOENT)
+            syslog(LOG_ERR, "Error renaming %s to %s: %m",
+                   XORG_CONF, XORG_CONF_OLD);
+        g_free(xorg_conf_content);
+        xorg_conf_content = NULL;
+        return;
+    }
+
+    conf = render_xorg_conf(monitor_conf);
+
+    /* Only touch the file if its content changes */
+    if (!xorg_conf_content)
+        g_file_get_contents(XORG_CONF, &xorg_conf_content, NULL, NULL);
+    if (xorg_conf_content && strcmp(conf, xorg_conf_content) == 0) {
+        g_free(conf);
+        return;
+    }
+
+    if (backup_xorg_conf()) {
+        syslog(LOG_ERR, "not generating xorg.conf");
+        g_free(conf);
+        return;
+    }
+
+    /* This writes to a temporary file which is then renamed to xorg.conf */
+    if (!g_file_set_contents(XORG_CONF, conf, -1, &err)) {
+        syslog(LOG_ERR, "Error writing %s: %s", XORG_CONF, err->message);
+        g_error_free(err);
+        g_free(conf);
+        return;
+    }
+
+    g_free(xorg_conf_content);
+    xorg_conf_content = conf;
 #endif
 }
@@ -25,5 +25,8 @@
 #include <spice/vd_agent.h>
 
 void vdagentd_write_xorg_conf(VDAgentMonitorsConfig *monitor_conf);
+/* Forget the cached QXL devices and xorg.conf content, so that the next
+   vdagentd_write_xorg_conf() enumerates and reads them again */
+void vdagentd_xorg_conf_invalidate(void);
 
 #endif
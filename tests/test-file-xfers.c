@@ -0,0 +1,391 @@
+/*  vdagent file xfers tests
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/select.h>
+#include <spice/vd_agent.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "vdagentd-proto.h"
+#include "vdagent/file-xfers.h"
+
+#define NO_STATUS G_MAXUINT32
+
+/* These replace the connection to vdagentd: they record the last status
+   the agent reported and the pipe it passed for direct xfers */
+static uint32_t last_status = NO_STATUS;
+static int direct_fd = -1;
+static int refuse_direct;
+
+int udscs_write(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, const uint8_t *data, uint32_t size)
+{
+    if (type == VDAGENTD_FILE_XFER_STATUS &&
+            arg2 != VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
+        last_status = arg2;
+    return 0;
+}
+
+int udscs_write_fd(struct udscs_connection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, const uint8_t *data, uint32_t size, int fd)
+{
+    g_assert_cmpuint(type, ==, VDAGENTD_FILE_XFER_DIRECT);
+    if (refuse_direct)
+        return -1;
+    direct_fd = dup(fd);
+    g_assert_cmpint(direct_fd, !=, -1);
+    return 0;
+}
+
+typedef struct {
+    gchar *save_dir;
+    struct vdagent_file_xfers *xfers;
+} Fixture;
+
+static void fixture_setup(Fixture *f, gconstpointer user_data)
+{
+    f->save_dir = g_build_filename(g_get_tmp_dir(), "test-file-xfers-XXXXXX",
+                                   NULL);
+    if (!mkdtemp(f->save_dir))
+        g_error("failed to create %s: %s", f->save_dir, g_strerror(errno));
+    f->xfers = vdagent_file_xfers_create(NULL, f->save_dir, 0,
+                                         VDAGENT_FILE_XFERS_SYNC_NONE, 0);
+    last_status = NO_STATUS;
+    direct_fd = -1;
+    refuse_direct = 0;
+}
+
+static void fixture_teardown(Fixture *f, gconstpointer user_data)
+{
+    GDir *dir;
+    const gchar *name;
+
+    vdagent_file_xfers_destroy(f->xfers);
+    if (direct_fd != -1)
+        close(direct_fd);
+
+    dir = g_dir_open(f->save_dir, 0, NULL);
+    while (dir && (name = g_dir_read_name(dir))) {
+        gchar *path = g_build_filename(f->save_dir, name, NULL);
+        g_unlink(path);
+        g_free(path);
+    }
+    if (dir)
+        g_dir_close(dir);
+    g_rmdir(f->save_dir);
+    g_free(f->save_dir);
+}
+
+/* Text like data, compressible but not trivially so */
+static guint8 *make_corpus(gsize size)
+{
+    GString *corpus = g_string_sized_new(size + 64);
+    GRand *rand = g_rand_new_with_seed(42);
+
+    while (corpus->len < size)
+        g_string_append_printf(corpus, "line %u: value=%d flags=%x\n",
+                               (unsigned int)corpus->len,
+                               g_rand_int_range(rand, 0, 1000),
+                               g_rand_int_range(rand, 0, 16));
+    g_rand_free(rand);
+    g_string_truncate(corpus, size);
+
+    return (guint8 *)g_string_free(corpus, FALSE);
+}
+
+static void start_xfer(Fixture *f, uint32_t id, const char *name,
+                       uint64_t size, const char *compression)
+{
+    VDAgentFileXferStartMessage *msg;
+    gchar *keyfile;
+
+    keyfile = g_strdup_printf("[vdagent-file-xfer]\n"
+                              "name=%s\n"
+                              "size=%" G_GUINT64_FORMAT "\n"
+                              "%s%s\n",
+                              name, size,
+                              compression ? "compression=" : "",
+                              compression ? compression : "");
+    msg = g_malloc(sizeof(*msg) + strlen(keyfile) + 1);
+    msg->id = id;
+    strcpy((char *)msg->data, keyfile);
+    vdagent_file_xfers_start(f->xfers, msg);
+    g_free(msg);
+    g_free(keyfile);
+}
+
+/* Goes through VDAGENTD_FILE_XFER_DATA, like the data vdagentd passes on */
+static void send_data(Fixture *f, uint32_t id, const guint8 *data,
+                      gsize size, gsize chunk_size)
+{
+    VDAgentFileXferDataMessage *msg;
+    gsize pos, n;
+
+    msg = g_malloc(sizeof(*msg) + chunk_size);
+    for (pos = 0; pos < size && last_status == NO_STATUS; pos += n) {
+        n = MIN(chunk_size, size - pos);
+        msg->id = id;
+        msg->size = n;
+        memcpy(msg->data, data + pos, n);
+        vdagent_file_xfers_data(f->xfers, msg);
+    }
+    g_free(msg);
+}
+
+/* Lets the agent move the data from the pipe of direct xfers to the files */
+static void handle_pipes(Fixture *f)
+{
+    struct timeval tv = { 0, 0 };
+    fd_set readfds;
+    int nfds;
+
+    FD_ZERO(&readfds);
+    nfds = vdagent_file_xfers_fill_fds(f->xfers, &readfds);
+    if (nfds == -1)
+        return;
+    if (select(nfds + 1, &readfds, NULL, NULL, &tv) > 0)
+        vdagent_file_xfers_handle_fds(f->xfers, &readfds);
+}
+
+static void assert_file_content(Fixture *f, const char *name,
+                                const guint8 *data, gsize size)
+{
+    gchar *path = g_build_filename(f->save_dir, name, NULL);
+    gchar *content = NULL;
+    gsize len = 0;
+    gboolean ok;
+
+    ok = g_file_get_contents(path, &content, &len, NULL);
+    g_assert(ok);
+    g_assert_cmpuint(len, ==, size);
+    g_assert(memcmp(content, data, size) == 0);
+    g_free(content);
+    g_free(path);
+}
+
+static void assert_no_file(Fixture *f, const char *name)
+{
+    gchar *path = g_build_filename(f->save_dir, name, NULL);
+
+    g_assert(!g_file_test(path, G_FILE_TEST_EXISTS));
+    g_free(path);
+}
+
+static void test_plain(Fixture *f, gconstpointer user_data)
+{
+    const gsize size = 300 * 1024;
+    guint8 *corpus = make_corpus(size);
+
+    refuse_direct = 1;
+    start_xfer(f, 1, "plain.txt", size, NULL);
+    send_data(f, 1, corpus, size, 4096);
+
+    g_assert_cmpuint(last_status, ==, VD_AGENT_FILE_XFER_STATUS_SUCCESS);
+    assert_file_content(f, "plain.txt", corpus, size);
+    g_free(corpus);
+}
+
+static void test_direct(Fixture *f, gconstpointer user_data)
+{
+    const gsize size = 300 * 1024;
+    guint8 *corpus = make_corpus(size);
+    gsize pos = 0;
+    ssize_t n;
+    int i;
+
+    start_xfer(f, 1, "direct.txt", size, NULL);
+    g_assert_cmpint(direct_fd, !=, -1);
+
+    /* The pipe is non-blocking, like vdagentd we wait for it to drain */
+    while (pos < size) {
+        n = write(direct_fd, corpus + pos, size - pos);
+        if (n > 0)
+            pos += n;
+        else
+            g_assert_cmpint(errno, ==, EAGAIN);
+        handle_pipes(f);
+    }
+    close(direct_fd);
+    direct_fd = -1;
+    for (i = 0; i < 1000 && last_status == NO_STATUS; i++)
+        handle_pipes(f);
+
+    g_assert_cmpuint(last_status, ==, VD_AGENT_FILE_XFER_STATUS_SUCCESS);
+    assert_file_content(f, "direct.txt", corpus, size);
+    g_free(corpus);
+}
+
+static void test_unknown_compression(Fixture *f, gconstpointer user_data)
+{
+    start_xfer(f, 1, "unknown.txt", 10, "foo");
+
+    g_assert_cmpuint(last_status, ==, VD_AGENT_FILE_XFER_STATUS_ERROR);
+    assert_no_file(f, "unknown.txt");
+}
+
+#ifdef HAVE_ZSTD
+static guint8 *compress_corpus(const guint8 *corpus, gsize size,
+                               gsize *compressed_size)
+{
+    gsize bound = ZSTD_compressBound(size);
+    guint8 *compressed = g_malloc(bound);
+
+    *compressed_size = ZSTD_compress(compressed, bound, corpus, size, 3);
+    g_assert(!ZSTD_isError(*compressed_size));
+    return compressed;
+}
+
+static void test_zstd(Fixture *f, gconstpointer user_data)
+{
+    const gsize size = 300 * 1024;
+    guint8 *corpus = make_corpus(size);
+    gsize compressed_size;
+    guint8 *compressed = compress_corpus(corpus, size, &compressed_size);
+
+    start_xfer(f, 1, "zstd.txt", size, "zstd");
+    /* The data has to go through the agent to be decompressed */
+    g_assert_cmpint(direct_fd, ==, -1);
+    send_data(f, 1, compressed, compressed_size, 1000);
+
+    g_assert_cmpuint(last_status, ==, VD_AGENT_FILE_XFER_STATUS_SUCCESS);
+    assert_file_content(f, "zstd.txt", corpus, size);
+    g_free(compressed);
+    g_free(corpus);
+}
+
+/* The end of the frame exactly fills the agent's decompression buffer */
+static void test_zstd_exact_buffer(Fixture *f, gconstpointer user_data)
+{
+    const gsize size = ZSTD_DStreamOutSize();
+    guint8 *corpus = make_corpus(size);
+    gsize compressed_size;
+    guint8 *compressed = compress_corpus(corpus, size, &compressed_size);
+
+    start_xfer(f, 1, "exact.txt", size, "zstd");
+    send_data(f, 1, compressed, compressed_size, compressed_size);
+
+    g_assert_cmpuint(last_status, ==, VD_AGENT_FILE_XFER_STATUS_SUCCESS);
+    assert_file_content(f, "exact.txt", corpus, size);
+    g_free(compressed);
+    g_free(corpus);
+}
+
+/* The frame decompresses to less than the announced size */
+static void test_zstd_short_frame(Fixture *f, gconstpointer user_data)
+{
+    const gsize size = 300 * 1024;
+    guint8 *corpus = make_corpus(size);
+    gsize compressed_size;
+    guint8 *compressed = compress_corpus(corpus, size, &compressed_size);
+
+    start_xfer(f, 1, "short.txt", size + 1, "zstd");
+    send_data(f, 1, compressed, compressed_size, 1000);
+
+    g_assert_cmpuint(last_status, ==, VD_AGENT_FILE_XFER_STATUS_ERROR);
+    assert_no_file(f, "short.txt");
+    g_free(compressed);
+    g_free(corpus);
+}
+
+static void test_zstd_trailing_data(Fixture *f, gconstpointer user_data)
+{
+    const gsize size = 300 * 1024;
+    guint8 *corpus = make_corpus(size);
+    gsize compressed_size;
+    guint8 *compressed = compress_corpus(corpus, size, &compressed_size);
+
+    compressed = g_realloc(compressed, compressed_size + 16);
+    memset(compressed + compressed_size, 'x', 16);
+    start_xfer(f, 1, "trailing.txt", size, "zstd");
+    /* One chunk, so the garbage comes along with the end of the frame */
+    send_data(f, 1, compressed, compressed_size + 16, compressed_size + 16);
+
+    g_assert_cmpuint(last_status, ==, VD_AGENT_FILE_XFER_STATUS_ERROR);
+    assert_no_file(f, "trailing.txt");
+    g_free(compressed);
+    g_free(corpus);
+}
+
+/* Run with -m perf: the throughput of the VDAGENTD_FILE_XFER_DATA path
+   with and without compression, in MB of file data per second */
+static void test_zstd_throughput(Fixture *f, gconstpointer user_data)
+{
+    const gsize size = 64 * 1024 * 1024;
+    guint8 *corpus = make_corpus(size);
+    gsize compressed_size;
+    guint8 *compressed = compress_corpus(corpus, size, &compressed_size);
+    gdouble elapsed;
+
+    refuse_direct = 1;
+    g_test_timer_start();
+    start_xfer(f, 1, "perf-plain.txt", size, NULL);
+    send_data(f, 1, corpus, size, 64 * 1024);
+    elapsed = g_test_timer_elapsed();
+    g_assert_cmpuint(last_status, ==, VD_AGENT_FILE_XFER_STATUS_SUCCESS);
+    g_test_message("uncompressed: %" G_GSIZE_FORMAT " bytes in %.3fs",
+                   size, elapsed);
+    g_test_maximized_result(size / elapsed / 1e6, "uncompressed MB/s");
+
+    last_status = NO_STATUS;
+    g_test_timer_start();
+    start_xfer(f, 2, "perf-zstd.txt", size, "zstd");
+    send_data(f, 2, compressed, compressed_size, 64 * 1024);
+    elapsed = g_test_timer_elapsed();
+    g_assert_cmpuint(last_status, ==, VD_AGENT_FILE_XFER_STATUS_SUCCESS);
+    g_test_message("zstd: %" G_GSIZE_FORMAT " bytes (%" G_GSIZE_FORMAT
+                   " on the wire) in %.3fs", size, compressed_size, elapsed);
+    g_test_maximized_result(size / elapsed / 1e6, "zstd MB/s");
+
+    g_free(compressed);
+    g_free(corpus);
+}
+#endif
+
+static void add_test(const char *path,
+                     void (*test)(Fixture *, gconstpointer))
+{
+    g_test_add(path, Fixture, NULL, fixture_setup, test, fixture_teardown);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    add_test("/file-xfers/plain", test_plain);
+    add_test("/file-xfers/direct", test_direct);
+    add_test("/file-xfers/unknown-compression", test_unknown_compression);
+#ifdef HAVE_ZSTD
+    add_test("/file-xfers/zstd", test_zstd);
+    add_test("/file-xfers/zstd-exact-buffer", test_zstd_exact_buffer);
+    add_test("/file-xfers/zstd-short-frame", test_zstd_short_frame);
+    add_test("/file-xfers/zstd-trailing-data", test_zstd_trailing_data);
+    if (g_test_perf())
+        add_test("/file-xfers/zstd-throughput", test_zstd_throughput);
+#endif
+
+    return g_test_run();
+}